@@ -1,584 +1,3295 @@
 #include "shamap.h"
 
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <exception>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
 
-SHAMapAbstractNode::~SHAMapAbstractNode() = default;
+// SHA-512Half:  the first 256 bits of a SHA-512 digest
 
-void
-SHAMapInnerNode::setChild(int branch, std::shared_ptr<SHAMapAbstractNode> const& child)
+class SHA512HalfHasher
+{
+    std::uint64_t state_[8];
+    unsigned char buffer_[128];
+    std::uint64_t length_ = 0;  // bytes hashed so far
+
+    static std::uint64_t const K[80];
+
+public:
+    SHA512HalfHasher();
+
+    void operator()(void const* data, std::size_t len);
+    SHAMapHash finish();
+
+private:
+    void compress(unsigned char const* block);
+};
+
+std::uint64_t const SHA512HalfHasher::K[80] =
+{
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
+    0x3956c25bf348b538, 0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
+    0xd807aa98a3030242, 0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+    0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 0xc19bf174cf692694,
+    0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65,
+    0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+    0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4,
+    0xc6e00bf33da88fc2, 0xd5a79147930aa725, 0x06ca6351e003826f, 0x142929670a0e6e70,
+    0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+    0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b,
+    0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30,
+    0xd192e819d6ef5218, 0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+    0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8,
+    0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3,
+    0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b,
+    0xca273eceea26619c, 0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178,
+    0x06f067aa72176fba, 0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+    0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 0x431d67c49c100d4c,
+    0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817
+};
+
+SHA512HalfHasher::SHA512HalfHasher()
+    : state_{0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b,
+             0xa54ff53a5f1d36f1, 0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+             0x1f83d9abfb41bd6b, 0x5be0cd19137e2179}
 {
-    if (child != nullptr)
-        isBranch_ |= 1 << branch;
-    else
-        isBranch_ &= ~(1 << branch);
-    children_[branch] = child;
 }
 
-std::shared_ptr<SHAMapAbstractNode>
-SHAMapInnerNode::firstChild() const
+static
+inline
+std::uint64_t
+rotr(std::uint64_t x, unsigned n)
+{
+    return (x >> n) | (x << (64 - n));
+}
+
+void
+SHA512HalfHasher::compress(unsigned char const* block)
 {
-    for (int i = 0; i < 16; ++i)
+    std::uint64_t w[80];
+    for (unsigned i = 0; i < 16; ++i)
+    {
+        w[i] = 0;
+        for (unsigned j = 0; j < 8; ++j)
+            w[i] = (w[i] << 8) | block[8*i+j];
+    }
+    for (unsigned i = 16; i < 80; ++i)
+    {
+        auto s0 = rotr(w[i-15], 1) ^ rotr(w[i-15], 8) ^ (w[i-15] >> 7);
+        auto s1 = rotr(w[i-2], 19) ^ rotr(w[i-2], 61) ^ (w[i-2] >> 6);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    auto a = state_[0];
+    auto b = state_[1];
+    auto c = state_[2];
+    auto d = state_[3];
+    auto e = state_[4];
+    auto f = state_[5];
+    auto g = state_[6];
+    auto h = state_[7];
+    for (unsigned i = 0; i < 80; ++i)
     {
-        if (!isEmptyBranch(i))
-            return children_[i];
+        auto t1 = h + (rotr(e, 14) ^ rotr(e, 18) ^ rotr(e, 41)) +
+                  ((e & f) ^ (~e & g)) + K[i] + w[i];
+        auto t2 = (rotr(a, 28) ^ rotr(a, 34) ^ rotr(a, 39)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
     }
-    return {};
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
 }
 
 void
-SHAMapInnerNode::setChildren(std::shared_ptr<SHAMapTreeNode> const& child1,
-                             std::shared_ptr<SHAMapTreeNode> const& child2)
+SHA512HalfHasher::operator()(void const* data, std::size_t len)
 {
-    auto const& k1 = child1->peekItem()->key();
-    auto const& k2 = child2->peekItem()->key();
-    assert(k1 != k2);
-    for (; k1[depth_] == k2[depth_]; ++depth_)
-        common_[depth_] = k1[depth_];
-    unsigned b1;
-    unsigned b2;
-    if ((k1[depth_] & 0xF0) == (k2[depth_] & 0xF0))
+    if (len == 0)
+        return;
+    auto p = static_cast<unsigned char const*>(data);
+    auto used = length_ % 128;
+    length_ += len;
+    if (used != 0)
     {
-        common_[depth_] = k1[depth_] & 0xF0;
-        b1 = k1[depth_] & 0x0F;
-        b2 = k2[depth_] & 0x0F;
-        depth_ = 2*depth_ + 1;
+        auto n = std::min<std::size_t>(len, 128 - used);
+        std::memcpy(buffer_ + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 128)
+            return;
+        compress(buffer_);
     }
-    else
+    for (; len >= 128; p += 128, len -= 128)
+        compress(p);
+    std::memcpy(buffer_, p, len);
+}
+
+SHAMapHash
+SHA512HalfHasher::finish()
+{
+    auto const bits = length_ * 8;
+    auto used = length_ % 128;
+    buffer_[used++] = 0x80;
+    if (used > 112)
     {
-        b1 = k1[depth_] >> 4;
-        b2 = k2[depth_] >> 4;
-        depth_ = 2*depth_;
+        std::memset(buffer_ + used, 0, 128 - used);
+        compress(buffer_);
+        used = 0;
     }
-    children_[b1] = child1;
-    isBranch_ |= 1 << b1;
-    children_[b2] = child2;
-    isBranch_ |= 1 << b2;
+    std::memset(buffer_ + used, 0, 120 - used);
+    for (unsigned i = 0; i < 8; ++i)
+        buffer_[120+i] = static_cast<unsigned char>(bits >> (56 - 8*i));
+    compress(buffer_);
+    SHAMapHash r;
+    for (unsigned i = 0; i < r.size(); ++i)
+        r[i] = static_cast<unsigned char>(state_[i/8] >> (56 - 8*(i%8)));
+    return r;
 }
 
-bool
-SHAMapInnerNode::has_common_prefix(uint256 const& key) const
+// Hash prefixes, so that inner and leaf nodes can never hash alike
+static unsigned char const innerNodePrefix[4] = {'M', 'I', 'N', 0};
+static unsigned char const leafNodePrefix[4]  = {'M', 'L', 'N', 0};
+
+SHAMapAbstractNode::~SHAMapAbstractNode() = default;
+
+// SHAMapNodePool
+
+SHAMapNodePool::SHAMapNodePool(Mode mode)
+    : mode_{mode}
 {
-    auto x = common_.begin();
-    auto y = key.begin();
-    for (unsigned i = 0; i < depth_/2; ++i, ++x, ++y)
+}
+
+SHAMapNodePool::~SHAMapNodePool()
+{
+    for (auto slab : slabs_)
+        ::operator delete(slab);
+}
+
+thread_local SHAMapNodePool::ThreadCache* SHAMapNodePool::threadCache_ = nullptr;
+
+void*
+SHAMapNodePool::take(SizeClass& c, std::size_t size)
+{
+    if (c.free != nullptr)
     {
-        if (*x != *y)
-            return false;
+        auto p = c.free;
+        c.free = p->next;
+        return p;
     }
-    if (depth_ & 1)
+    if (c.next == c.end)
     {
-        auto i = depth_/2;
-        return (*(common_.begin() + i) & 0xF0) == (*(key.begin() + i) & 0xF0);
+        slabs_.push_back(nullptr);
+        auto slab = static_cast<unsigned char*>(::operator new(slabSize));
+        slabs_.back() = slab;
+        c.next = slab;
+        c.end = slab + slabSize / size * size;
     }
-    return true;
+    auto p = c.next;
+    c.next += size;
+    return p;
 }
 
-unsigned
-SHAMapInnerNode::get_common_prefix(uint256 const& key) const
+void*
+SHAMapNodePool::allocate(std::size_t bytes)
 {
-    auto x = common_.begin();
-    auto y = key.begin();
-    auto r = 0;
-    for (unsigned i = 0; i < depth_/2; ++i, ++x, ++y, r += 2)
+    if (bytes > maxBlock)
+        return ::operator new(bytes);
+    auto const size = blockSize(bytes);
+    auto& c = classes_[size / granularity - 1];
+    auto const cache = threadCache_;
+    if (cache == nullptr || &cache->pool_ != this)
     {
-        if (*x != *y)
+        std::lock_guard<std::mutex> lock{mutex_};
+        return take(c, size);
+    }
+    auto& l = cache->lists_[size / granularity - 1];
+    if (l.free == nullptr)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (; l.size < cacheBatch; ++l.size)
         {
-            if ((*x & 0xF0) == (*y & 0xF0))
-                ++r;
-            return r;
+            auto block = static_cast<FreeBlock*>(take(c, size));
+            block->next = l.free;
+            l.free = block;
         }
     }
-    if (depth_ & 1)
+    auto p = l.free;
+    l.free = p->next;
+    --l.size;
+    return p;
+}
+
+void
+SHAMapNodePool::deallocate(void* p, std::size_t bytes) noexcept
+{
+    if (bytes > maxBlock)
+    {
+        ::operator delete(p);
+        return;
+    }
+    if (mode_ == arena)
+        return;
+    auto const size = blockSize(bytes);
+    auto& c = classes_[size / granularity - 1];
+    auto block = static_cast<FreeBlock*>(p);
+    auto const cache = threadCache_;
+    if (cache == nullptr || &cache->pool_ != this)
     {
-        auto i = depth_/2;
-        if ((*(common_.begin() + i) & 0xF0) == (*(key.begin() + i) & 0xF0))
-            ++r;
+        std::lock_guard<std::mutex> lock{mutex_};
+        block->next = c.free;
+        c.free = block;
+        return;
+    }
+    auto& l = cache->lists_[size / granularity - 1];
+    block->next = l.free;
+    l.free = block;
+    if (++l.size < 2 * cacheBatch)
+        return;
+    // Give half back, so that a thread that mostly frees does not hoard
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (; l.size > cacheBatch; --l.size)
+    {
+        block = l.free;
+        l.free = block->next;
+        block->next = c.free;
+        c.free = block;
     }
-    return r;
 }
 
-void
-SHAMapInnerNode::set_common(unsigned depth, uint256 const& common)
+SHAMapNodePool::ThreadCache::ThreadCache(SHAMapNodePool& pool)
+    : pool_{pool}
+    , outer_{threadCache_}
 {
-    depth_ = depth;
-    common_ = common;
+    threadCache_ = this;
 }
 
-unsigned
-SHAMapInnerNode::numChildren() const
+SHAMapNodePool::ThreadCache::~ThreadCache()
 {
-    auto n = 0u;
-    for (auto m = 0x8000u; m != 0; m >>= 1)
-        n += (isBranch_ & m) != 0;
-    return n;
+    assert(threadCache_ == this);
+    threadCache_ = outer_;
+    std::lock_guard<std::mutex> lock{pool_.mutex_};
+    for (std::size_t i = 0; i < maxBlock / granularity; ++i)
+    {
+        auto& c = pool_.classes_[i];
+        while (lists_[i].free != nullptr)
+        {
+            auto block = lists_[i].free;
+            lists_[i].free = block->next;
+            block->next = c.free;
+            c.free = block;
+        }
+    }
 }
 
-unsigned char
-strhex(unsigned char c)
+// The hash and length that precede each wire form in a SHAMapFileStore
+static constexpr std::uint64_t fileRecordHeader = sizeof(SHAMapHash) + 4;
+
+SHAMapFileStore::SHAMapFileStore(std::string const& path)
 {
-    if (c < 10)
-        return c + '0';
-    return c - 10 + 'A';
+    // create the file if it does not exist, without truncating it
+    std::ofstream{path, std::ios::binary | std::ios::app};
+    file_.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!file_)
+        throw std::runtime_error("SHAMapFileStore: cannot open " + path);
+    file_.seekg(0, std::ios::end);
+    std::uint64_t const fileSize = file_.tellg();
+    while (end_ + fileRecordHeader <= fileSize)
+    {
+        SHAMapHash hash;
+        unsigned char size[4];
+        file_.seekg(end_);
+        file_.read(reinterpret_cast<char*>(hash.data()), hash.size());
+        file_.read(reinterpret_cast<char*>(size), sizeof(size));
+        std::uint32_t const n = std::uint32_t{size[0]} << 24 | size[1] << 16 |
+                                size[2] << 8 | size[3];
+        if (!file_ || end_ + fileRecordHeader + n > fileSize)
+            break;
+        index_.emplace(hash, std::make_pair(end_ + fileRecordHeader, n));
+        end_ += fileRecordHeader + n;
+    }
+    file_.clear();
 }
 
 void
-SHAMapInnerNode::display(std::ostream& os, unsigned indent) const
+SHAMapFileStore::store(SHAMapHash const& hash, Blob const& data)
 {
-    os << std::string(indent, ' ') << "inner{" << depth_ << ", ";
-    os << '{';
-    for (auto c : common_)
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (index_.count(hash) != 0)
+        return;
+    auto const n = static_cast<std::uint32_t>(data.size());
+    unsigned char const size[4] = {static_cast<unsigned char>(n >> 24),
+                                   static_cast<unsigned char>(n >> 16),
+                                   static_cast<unsigned char>(n >> 8),
+                                   static_cast<unsigned char>(n)};
+    file_.seekp(end_);
+    file_.write(reinterpret_cast<char const*>(hash.data()), hash.size());
+    file_.write(reinterpret_cast<char const*>(size), sizeof(size));
+    file_.write(reinterpret_cast<char const*>(data.data()), data.size());
+    file_.flush();
+    if (!file_)
+        throw std::runtime_error("SHAMapFileStore: write failed");
+    index_.emplace(hash, std::make_pair(end_ + fileRecordHeader, n));
+    end_ += fileRecordHeader + n;
+}
+
+bool
+SHAMapFileStore::fetch(SHAMapHash const& hash, Blob& data)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto i = index_.find(hash);
+    if (i == index_.end())
+        return false;
+    data.resize(i->second.second);
+    file_.seekg(i->second.first);
+    file_.read(reinterpret_cast<char*>(data.data()), data.size());
+    if (!file_)
     {
-        os << strhex(c >> 4);
-        os << strhex(c & 0x0F);
+        file_.clear();
+        return false;
     }
-    os << "}, " << std::hex << isBranch_ << std::dec << "}\n";
-    for (unsigned branch = 0; branch < 16; ++branch)
+    return true;
+}
+
+std::size_t
+SHAMapNodeCache::HashHasher::operator()(SHAMapHash const& h) const
+{
+    // node hashes are already uniformly distributed
+    std::size_t r;
+    std::memcpy(&r, h.data(), sizeof(r));
+    return r;
+}
+
+SHAMapNodeCache::SHAMapNodeCache(std::size_t budget, unsigned shards)
+    : pool_{std::make_shared<SHAMapNodePool>()}
+    , budget_{budget}
+    , shards_(std::max(shards, 1u))
+{
+}
+
+// The memory held by node, as charged against the budget
+static
+std::size_t
+nodeBytes(SHAMapAbstractNode const& node)
+{
+    if (node.isLeaf())
+        return sizeof(SHAMapTreeNode) +
+               static_cast<SHAMapTreeNode const&>(node).peekItem().data().size();
+    // The slot block is a second allocation, sized by capacity rather than
+    // by the number of children
+    return SHAMapNodePool::blockSize(sizeof(SHAMapInnerNode)) +
+           SHAMapNodePool::blockSize(
+               static_cast<SHAMapInnerNode const&>(node).slotBlockBytes());
+}
+
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMapNodeCache::fetch(SHAMapHash const& hash)
+{
+    // shards are picked by the last byte, hash tables use the first ones
+    auto& shard = shards_[hash.back() % shards_.size()];
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    auto i = shard.index.find(hash);
+    if (i == shard.index.end())
     {
-        if (children_[branch] == nullptr)
-            os << std::string(indent+2, ' ') << "nullptr\n";
-        else
-            children_[branch]->display(os, indent+2);
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return {};
     }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    auto& entry = shard.entries[i->second];
+    entry.referenced = true;
+    return entry.node;
 }
 
 void
-SHAMapInnerNode::invariants(bool is_root) const
+SHAMapNodeCache::insert(SHAMapNodePtr<SHAMapAbstractNode> const& node)
 {
-    unsigned count = 0;
-    for (unsigned i = 0; i < 16; ++i)
+    assert(!node->isDirty() && node->cowid() == 0);
+    auto const& hash = node->getHash();
+    auto& shard = shards_[hash.back() % shards_.size()];
+    auto const budget = budget_ / shards_.size();
+    auto const bytes = nodeBytes(*node);
+    if (bytes > budget)
+        return;
+    std::lock_guard<std::mutex> lock{shard.mutex};
+    if (shard.index.count(hash) != 0)
+        return;
+    // Sweep the clock hand, giving each referenced entry a second chance,
+    // until there is room
+    while (shard.bytes + bytes > budget)
     {
-        if (children_[i] == nullptr)
-        {
-            assert((isBranch_ & (1 << i)) == 0);
-        }
-        else
+        if (shard.hand >= shard.entries.size())
+            shard.hand = 0;
+        auto& entry = shard.entries[shard.hand];
+        if (entry.node != nullptr)
         {
-            assert((isBranch_ & (1 << i)) != 0);
-            assert(has_common_prefix(children_[i]->key()));
-            children_[i]->invariants();
-            ++count;
+            if (entry.referenced)
+                entry.referenced = false;
+            else
+            {
+                shard.index.erase(entry.hash);
+                shard.bytes -= entry.bytes;
+                entry.node = nullptr;
+                shard.free.push_back(shard.hand);
+            }
         }
+        ++shard.hand;
     }
-    if (!is_root)
+    std::size_t slot;
+    if (!shard.free.empty())
     {
-        assert(count >= 2);
-        assert(depth_ > 0);
+        slot = shard.free.back();
+        shard.free.pop_back();
     }
     else
-        assert(depth_ == 0);
+    {
+        slot = shard.entries.size();
+        shard.entries.emplace_back();
+    }
+    auto& entry = shard.entries[slot];
+    entry.hash = hash;
+    entry.node = node;
+    entry.bytes = bytes;
+    entry.referenced = false;
+    shard.index.emplace(hash, slot);
+    shard.bytes += bytes;
 }
 
-uint256 const&
-SHAMapInnerNode::key() const
+std::size_t
+SHAMapNodeCache::bytes()
 {
-    return common_;
+    std::size_t r = 0;
+    for (auto& shard : shards_)
+    {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        r += shard.bytes;
+    }
+    return r;
 }
 
-unsigned
-SHAMapInnerNode::depth() const
+SHAMapMissingNode::SHAMapMissingNode(SHAMapHash const& hash)
+    : std::runtime_error("SHAMap: missing node")
+    , hash_{hash}
 {
-    return depth_;
 }
 
-void
-SHAMapTreeNode::display(std::ostream& os, unsigned indent) const
+static
+int
+selectBranch(unsigned depth, uint256 const& key)
 {
-    os << std::string(indent, ' ') << "leaf{";
-    for (auto c : item_->key())
-    {
-        os << strhex(c >> 4);
-        os << strhex(c & 0x0F);
-    }
-    os << "}\n";
+    auto branch = *(key.begin() + depth/2);
+    if (depth & 1)
+        branch &= 0xf;
+    else
+        branch >>= 4;
+    return branch;
 }
 
-void
-SHAMapTreeNode::invariants(bool) const
+static
+uint256
+prefix(unsigned depth, uint256 const& key)
 {
-    assert(item_ != nullptr);
+    uint256 r{};
+    auto x = r.begin();
+    auto y = key.begin();
+    for (auto i = 0u; i < depth/2; ++i, ++x, ++y)
+        *x = *y;
+    if (depth & 1)
+        *x = *y & 0xF0;
+    return r;
 }
 
-uint256 const&
-SHAMapTreeNode::key() const
+static
+inline
+unsigned
+countTrailingZeros(std::uint32_t x)
 {
-    return item_->key();
+#if defined(_MSC_VER)
+    unsigned long r;
+    _BitScanForward(&r, x);
+    return r;
+#else
+    return __builtin_ctz(x);
+#endif
 }
 
-unsigned
-SHAMapTreeNode::depth() const
+static
+inline
+void
+prefetch(void const* p)
 {
-    return 64;
+#if defined(_MSC_VER)
+    _mm_prefetch(static_cast<char const*>(p), _MM_HINT_T0);
+#else
+    __builtin_prefetch(p);
+#endif
 }
 
+// The index of the first byte in which x and y differ, or 32 if they are
+// equal.  Compares all 32 bytes at once where the target has SSE2 or AVX2,
+// and locates the first difference with a count-trailing-zeros.
+static
+inline
 unsigned
-SHAMapInnerNode::max_depth(unsigned parent_depth) const
+firstDifference(uint256 const& x, uint256 const& y)
 {
-    unsigned depth_below_here = 0;
-    for (unsigned i = 0; i < 16; ++i)
+#if defined(__AVX2__)
+    auto const a = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x.data()));
+    auto const b = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(y.data()));
+    auto const eq = static_cast<std::uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+    return eq == 0xFFFFFFFF ? 32 : countTrailingZeros(~eq);
+#elif defined(__SSE2__) || defined(_M_X64)
+    auto const a0 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(x.data()));
+    auto const b0 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(y.data()));
+    auto const a1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(x.data() + 16));
+    auto const b1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(y.data() + 16));
+    auto const eq =
+        static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a0, b0))) |
+        static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a1, b1))) << 16;
+    return eq == 0xFFFFFFFF ? 32 : countTrailingZeros(~eq);
+#else
+    // Skip equal 8-byte words, then finish byte by byte
+    unsigned i = 0;
+    for (; i < 32; i += 8)
     {
-        if (children_[i] != nullptr)
-        {
-            depth_below_here = std::max(depth_below_here, children_[i]->max_depth(0));
-        }
+        std::uint64_t a;
+        std::uint64_t b;
+        std::memcpy(&a, x.data() + i, 8);
+        std::memcpy(&b, y.data() + i, 8);
+        if (a != b)
+            break;
     }
-    return parent_depth + 1 + depth_below_here;
+    for (; i < 32 && x[i] == y[i]; ++i)
+        ;
+    return i;
+#endif
 }
 
+// The number of leading nibbles that x and y have in common, in [0, 64]
+static
+inline
 unsigned
-SHAMapTreeNode::max_depth(unsigned parent_depth) const
+commonNibbles(uint256 const& x, uint256 const& y)
 {
-    return parent_depth + 1;
+    auto const i = firstDifference(x, y);
+    if (i == 32)
+        return 64;
+    return 2*i + ((x[i] ^ y[i]) < 0x10);
 }
 
+// The smallest slot block that holds n children
+static
 unsigned
-SHAMap::max_depth() const
+slotCapacity(unsigned n)
 {
-    return root_->max_depth(0);
+    if (n == 0)
+        return 0;
+    if (n <= 2)
+        return 2;
+    if (n <= 4)
+        return 4;
+    if (n <= 8)
+        return 8;
+    return 16;
 }
 
-std::ostream&
-operator<<(std::ostream& os, SHAMapItem const& x)
+static constexpr std::size_t slotBytes = sizeof(SHAMapNodePtr<SHAMapAbstractNode>) +
+                                         sizeof(SHAMapHash);
+
+std::size_t
+SHAMapInnerNode::slotBlockBytes() const
 {
-    os << '{';
-    for (auto c : x.tag_)
+    return capacity_ * slotBytes;
+}
+
+SHAMapInnerNode::SHAMapInnerNode(SHAMapNodePool& pool, SHAMapInnerNode const& other,
+                                 std::uint32_t cowid)
+    : SHAMapAbstractNode{Kind::inner, pool, cowid}
+    , depth_{other.depth_}
+    , common_(other.common_)
+    , count_{other.count_}
+{
+    hash_ = other.hash_;
+    dirty_ = other.dirty_;
+    stored_ = other.stored_;
+    auto const n = other.numChildren();
+    resize(slotCapacity(n));
+    std::copy(other.children(), other.children() + n, children());
+    std::copy(other.hashes(), other.hashes() + n, hashes());
+    isBranch_ = other.isBranch_;
+}
+
+SHAMapInnerNode::~SHAMapInnerNode()
+{
+    isBranch_ = 0;
+    resize(0);
+}
+
+// Move the occupied slots into a new block of the given capacity, which
+// may be 0 only when no branch is set
+void
+SHAMapInnerNode::resize(unsigned capacity)
+{
+    auto const n = numChildren();
+    assert(n <= capacity);
+    ChildPtr* children = nullptr;
+    if (capacity != 0)
     {
-        os << strhex(c >> 4);
-        os << strhex(c & 0x0F);
+        children = static_cast<ChildPtr*>(pool_->allocate(capacity * slotBytes));
+        for (unsigned i = 0; i < capacity; ++i)
+            ::new(children + i) ChildPtr{};
+        auto hashes = reinterpret_cast<SHAMapHash*>(children + capacity);
+        std::move(this->children(), this->children() + n, children);
+        std::copy(this->hashes(), this->hashes() + n, hashes);
     }
-    os << ", ";
-    for (auto c : x.data_)
+    if (slots_ != nullptr)
     {
-        os << strhex(c >> 4);
-        os << strhex(c & 0x0F);
+        for (unsigned i = 0; i < capacity_; ++i)
+            this->children()[i].~ChildPtr();
+        pool_->deallocate(slots_, capacity_ * slotBytes);
     }
-    os << '}';
-    return os;
+    slots_ = children;
+    capacity_ = capacity;
 }
 
-std::ostream&
-operator<<(std::ostream& os, SHAMap const& x)
+void
+SHAMapInnerNode::setChild(int branch, SHAMapNodePtr<SHAMapAbstractNode> child)
 {
-    os << "{\n";
-    for (auto const& i : x)
-        os << "    " << i << '\n';
-    os << "}";
-    return os;
+    auto const bit = 1u << branch;
+    auto const i = slot(branch);
+    auto const n = numChildren();
+    if ((isBranch_ & bit) != 0)
+    {
+        if (child != nullptr)
+        {
+            children()[i] = std::move(child);
+            return;
+        }
+        // close the gap left by branch
+        std::move(children() + i + 1, children() + n, children() + i);
+        children()[n-1] = nullptr;
+        std::copy(hashes() + i + 1, hashes() + n, hashes() + i);
+        isBranch_ &= ~bit;
+        if (2*(n-1) < capacity_)
+            resize(slotCapacity(n-1));
+    }
+    else if (child != nullptr)
+    {
+        if (n == capacity_)
+            resize(slotCapacity(n+1));
+        // open a gap for branch
+        std::move_backward(children() + i, children() + n, children() + n + 1);
+        std::copy_backward(hashes() + i, hashes() + n, hashes() + n + 1);
+        children()[i] = std::move(child);
+        hashes()[i] = SHAMapHash{};
+        isBranch_ |= bit;
+    }
 }
 
 void
-SHAMap::display(std::ostream& os) const
+SHAMapInnerNode::prefetchChild(int m) const
 {
-    root_->display(os, 0);
+    assert(!isEmptyBranch(m));
+    prefetch(children() + slot(m));
 }
 
-SHAMap::SHAMap()
-    : root_{std::make_shared<SHAMapInnerNode>(uint256{'r', 'o', 'o', 't'})}
+void
+SHAMapInnerNode::unloadChild(int m)
 {
+    assert(!isEmptyBranch(m));
+    children()[slot(m)] = nullptr;
 }
 
-SHAMapItem const*
-SHAMap::peekFirstItem(NodeStack& stack) const
+void
+SHAMapInnerNode::reserve(unsigned n)
 {
-    assert(stack.empty());
-    auto node = firstBelow(root_, stack);
-    if (!node)
-    {
-        while (!stack.empty())
-            stack.pop_back();
-        return nullptr;
-    }
-    return node->peekItem().get();
+    if (capacity_ < n)
+        resize(slotCapacity(n));
 }
 
-static
-int
-selectBranch(unsigned depth, uint256 const& key)
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMapInnerNode::getChild(int m) const
 {
-    auto branch = *(key.begin() + depth/2);
-    if (depth & 1)
-        branch &= 0xf;
-    else
-        branch >>= 4;
-    return branch;
+    if (isEmptyBranch(m))
+        return {};
+    return children()[slot(m)];
 }
 
-SHAMapItem const*
-SHAMap::peekNextItem(uint256 const& id, NodeStack& stack) const
+SHAMapHash const&
+SHAMapInnerNode::getChildHash(int m) const
 {
-    assert(!stack.empty());
-    stack.pop_back();
-    while (!stack.empty())
-    {
-        auto node = stack.back().first;
-        auto nodeID = stack.back().second;
-        assert(!node->isLeaf());
-        auto inner = std::static_pointer_cast<SHAMapInnerNode>(node);
-        for (auto i = selectBranch(nodeID.depth(), id) + 1; i < 16; ++i)
-        {
-            if (!inner->isEmptyBranch(i))
-            {
-                node = descendThrow(inner, i);
-                auto leaf = firstBelow(node, stack);
-                if (!leaf)
-                    throw 3;
-                assert(leaf->isLeaf());
-                return leaf->peekItem().get();
-            }
-        }
-        stack.pop_back();
-    }
-    // must be last item
-    return nullptr;
+    static SHAMapHash const zero{};
+    if (isEmptyBranch(m))
+        return zero;
+    return hashes()[slot(m)];
 }
 
-SHAMapTreeNode*
-SHAMap::firstBelow(std::shared_ptr<SHAMapAbstractNode> node, NodeStack& stack) const
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMapInnerNode::firstChild() const
 {
-    // Return the first item at or below this node
+    if (isBranch_ == 0)
+        return {};
+    return children()[0];
+}
+
+void
+SHAMapInnerNode::setChildren(SHAMapNodePtr<SHAMapTreeNode> child1,
+                             SHAMapNodePtr<SHAMapTreeNode> child2)
+{
+    auto const& k1 = child1->peekItem().key();
+    auto const& k2 = child2->peekItem().key();
+    assert(k1 != k2);
+    depth_ = commonNibbles(k1, k2);
+    common_ = prefix(depth_, k1);
+    auto const b1 = selectBranch(depth_, k1);
+    auto const b2 = selectBranch(depth_, k2);
+    setChild(b1, std::move(child1));
+    setChild(b2, std::move(child2));
+    count_ = 2;
+}
+
+bool
+SHAMapInnerNode::has_common_prefix(uint256 const& key) const
+{
+    return commonNibbles(common_, key) >= depth_;
+}
+
+unsigned
+SHAMapInnerNode::get_common_prefix(uint256 const& key) const
+{
+    return std::min(commonNibbles(common_, key), unsigned{depth_});
+}
+
+void
+SHAMapInnerNode::set_common(unsigned depth, uint256 const& common)
+{
+    depth_ = depth;
+    common_ = common;
+}
+
+unsigned char
+strhex(unsigned char c)
+{
+    if (c < 10)
+        return c + '0';
+    return c - 10 + 'A';
+}
+
+std::size_t
+SHAMapInnerNode::header(unsigned char* buf) const
+{
+    auto p = std::copy(std::begin(innerNodePrefix), std::end(innerNodePrefix), buf);
+    *p++ = depth_;
+    p = std::copy(common_.begin(), common_.begin() + (depth_ + 1) / 2, p);
+    *p++ = static_cast<unsigned char>(isBranch_ >> 8);
+    *p++ = static_cast<unsigned char>(isBranch_);
+    return p - buf;
+}
+
+// An inner node hashes its wire form: its prefix, its depth, the portion of
+// common_ that lies within that depth, its branch bitmap and the hashes of
+// its children in branch order.  Empty branches contribute nothing.
+void
+SHAMapInnerNode::updateHash()
+{
+    if (isBranch_ == 0)
+    {
+        // only an empty root has no children
+        hash_ = SHAMapHash{};
+        dirty_ = false;
+        return;
+    }
+    SHA512HalfHasher h;
+    unsigned char buf[maxHeader];
+    h(buf, header(buf));
+    auto const n = numChildren();
+    for (unsigned i = 0; i < n; ++i)
+    {
+        // A child that was never loaded keeps the hash it came with
+        auto const& child = children()[i];
+        if (child == nullptr)
+            continue;
+        if (child->isDirty())
+            child->updateHash();
+        hashes()[i] = child->getHash();
+    }
+    h(hashes(), n * sizeof(SHAMapHash));
+    hash_ = h.finish();
+    dirty_ = false;
+}
+
+void
+SHAMapInnerNode::serialize(Blob& out) const
+{
+    assert(isBranch_ != 0);
+    unsigned char buf[maxHeader];
+    auto const size = header(buf);
+    auto const hashes = reinterpret_cast<unsigned char const*>(this->hashes());
+    out.reserve(out.size() + size + numChildren() * sizeof(SHAMapHash));
+    out.insert(out.end(), buf, buf + size);
+    out.insert(out.end(), hashes, hashes + numChildren() * sizeof(SHAMapHash));
+}
+
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMapInnerNode::deserialize(SHAMapNodePool& pool, std::uint32_t cowid,
+                             unsigned char const* data, std::size_t size)
+{
+    if (size < 1 || data[0] >= 64)
+        return {};
+    unsigned const depth = data[0];
+    std::size_t const bytes = (depth + 1) / 2;
+    if (size < 1 + bytes + 2)
+        return {};
+    uint256 common{};
+    std::copy(data + 1, data + 1 + bytes, common.begin());
+    // the nibbles past depth must be zero
+    if (prefix(depth, common) != common)
+        return {};
+    std::uint16_t const isBranch = data[1 + bytes] << 8 | data[2 + bytes];
+    unsigned const n = std::bitset<16>(isBranch).count();
+    if (n == 0 || (depth > 0 && n < 2) ||
+        size != 3 + bytes + n * sizeof(SHAMapHash))
+        return {};
+    auto node = pool.make<SHAMapInnerNode>(cowid);
+    node->set_common(depth, common);
+    node->count_ = unknownCount;
+    node->resize(slotCapacity(n));
+    node->isBranch_ = isBranch;
+    std::copy(data + 3 + bytes, data + size,
+              reinterpret_cast<unsigned char*>(node->hashes()));
+    return node;
+}
+
+void
+SHAMapInnerNode::display(std::ostream& os, unsigned indent) const
+{
+    os << std::string(indent, ' ') << "inner{" << unsigned{depth_} << ", ";
+    os << '{';
+    for (auto c : common_)
+    {
+        os << strhex(c >> 4);
+        os << strhex(c & 0x0F);
+    }
+    os << "}, " << std::hex << isBranch_ << std::dec << "}\n";
+    for (unsigned branch = 0; branch < 16; ++branch)
+    {
+        auto child = getChildPointer(branch);
+        if (child == nullptr)
+            os << std::string(indent+2, ' ') << "nullptr\n";
+        else
+            child->display(os, indent+2);
+    }
+}
+
+void
+SHAMapInnerNode::invariants(bool is_root) const
+{
+    unsigned count = numChildren();
+    assert(count <= capacity_ && 2*count >= capacity_);
+    // A known item count is the sum of the counts below, where those are known
+    std::uint64_t items = 0;
+    for (unsigned i = 0; i < count && items != unknownCount; ++i)
+    {
+        auto const child = children()[i].get();
+        if (child == nullptr)
+            items = unknownCount;
+        else if (child->isLeaf())
+            ++items;
+        else if (static_cast<SHAMapInnerNode*>(child)->count_ == unknownCount)
+            items = unknownCount;
+        else
+            items += static_cast<SHAMapInnerNode*>(child)->count_;
+    }
+    assert(count_ == unknownCount || items == unknownCount || count_ == items);
+    for (unsigned i = 0; i < capacity_; ++i)
+    {
+        auto const& child = children()[i];
+        if (i >= count)
+        {
+            assert(child == nullptr);
+        }
+        else if (child != nullptr)  // else not loaded yet
+        {
+            assert(has_common_prefix(child->key()));
+            assert(dirty_ || (!child->isDirty() && hashes()[i] == child->getHash()));
+            child->invariants();
+        }
+    }
+    if (!is_root)
+    {
+        assert(count >= 2);
+        assert(depth_ > 0);
+    }
+    else
+        assert(depth_ == 0);
+}
+
+std::size_t const SHAMapTreeNode::maxInline =
+    SHAMapNodePool::maxBlock - sizeof(SHAMapTreeNode);
+
+SHAMapTreeNode::SHAMapTreeNode(SHAMapNodePool& pool, std::uint32_t cowid,
+                               uint256 const& key, unsigned char const* data,
+                               std::size_t size)
+    : SHAMapAbstractNode{Kind::leaf, pool, cowid}
+    , item_{key, payload(), size, SHAMapItem::Borrow{}}
+{
+    if (size != 0)
+        std::memcpy(payload(), data, size);
+}
+
+SHAMapNodePtr<SHAMapTreeNode>
+SHAMapTreeNode::make(SHAMapNodePool& pool, std::uint32_t cowid, uint256 const& key,
+                     unsigned char const* data, std::size_t size)
+{
+    if (size > maxInline)
+        return pool.make<SHAMapTreeNode>(cowid, SHAMapItem{key, data, size});
+    auto const bytes = sizeof(SHAMapTreeNode) + size;
+    void* p = pool.allocate(bytes);
+    SHAMapTreeNode* node;
+    try
+    {
+        node = ::new(p) SHAMapTreeNode(pool, cowid, key, data, size);
+    }
+    catch (...)
+    {
+        pool.deallocate(p, bytes);
+        throw;
+    }
+    return SHAMapNodePtr<SHAMapTreeNode>{node};
+}
+
+SHAMapNodePtr<SHAMapTreeNode>
+SHAMapTreeNode::make(SHAMapNodePool& pool, std::uint32_t cowid, SHAMapItem const& item)
+{
+    return make(pool, cowid, item.key(), item.data().data(), item.data().size());
+}
+
+SHAMapNodePtr<SHAMapTreeNode>
+SHAMapTreeNode::make(SHAMapNodePool& pool, std::uint32_t cowid, SHAMapItem&& item)
+{
+    if (item.data().size() <= maxInline)
+        return make(pool, cowid, item.key(), item.data().data(), item.data().size());
+    return pool.make<SHAMapTreeNode>(cowid, std::move(item));
+}
+
+SHAMapNodePtr<SHAMapTreeNode>
+SHAMapTreeNode::make(SHAMapNodePool& pool, std::uint32_t cowid, uint256 const& key,
+                     Blob&& data)
+{
+    if (data.size() <= maxInline)
+        return make(pool, cowid, key, data.data(), data.size());
+    return pool.make<SHAMapTreeNode>(cowid, SHAMapItem{key, std::move(data)});
+}
+
+std::size_t
+SHAMapTreeNode::bytes() const
+{
+    auto const data = item_.data();
+    if (data.size() != 0 && data.data() == payload())
+        return sizeof(SHAMapTreeNode) + data.size();
+    return sizeof(SHAMapTreeNode);
+}
+
+// A leaf hashes its wire form: its prefix, its key and its data
+void
+SHAMapTreeNode::updateHash()
+{
+    SHA512HalfHasher h;
+    h(leafNodePrefix, sizeof(leafNodePrefix));
+    h(item_.key().data(), item_.key().size());
+    h(item_.data().data(), item_.data().size());
+    hash_ = h.finish();
+    dirty_ = false;
+}
+
+void
+SHAMapTreeNode::serialize(Blob& out) const
+{
+    auto const& key = item_.key();
+    auto const data = item_.data();
+    out.reserve(out.size() + sizeof(leafNodePrefix) + key.size() + data.size());
+    out.insert(out.end(), std::begin(leafNodePrefix), std::end(leafNodePrefix));
+    out.insert(out.end(), key.begin(), key.end());
+    out.insert(out.end(), data.begin(), data.end());
+}
+
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMapTreeNode::deserialize(SHAMapNodePool& pool, std::uint32_t cowid,
+                            unsigned char const* data, std::size_t size)
+{
+    uint256 key;
+    if (size < key.size())
+        return {};
+    std::copy(data, data + key.size(), key.begin());
+    return SHAMapTreeNode::make(pool, cowid, key, data + key.size(), size - key.size());
+}
+
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMapAbstractNode::deserialize(SHAMapNodePool& pool, std::uint32_t cowid,
+                                void const* data, std::size_t size)
+{
+    auto const p = static_cast<unsigned char const*>(data);
+    SHAMapNodePtr<SHAMapAbstractNode> node;
+    if (size >= sizeof(innerNodePrefix) &&
+        std::equal(std::begin(innerNodePrefix), std::end(innerNodePrefix), p))
+        node = SHAMapInnerNode::deserialize(pool, cowid, p + sizeof(innerNodePrefix),
+                                            size - sizeof(innerNodePrefix));
+    else if (size >= sizeof(leafNodePrefix) &&
+        std::equal(std::begin(leafNodePrefix), std::end(leafNodePrefix), p))
+        node = SHAMapTreeNode::deserialize(pool, cowid, p + sizeof(leafNodePrefix),
+                                           size - sizeof(leafNodePrefix));
+    if (node != nullptr)
+    {
+        SHA512HalfHasher h;
+        h(data, size);
+        node->hash_ = h.finish();
+        node->dirty_ = false;
+    }
+    return node;
+}
+
+void
+SHAMapTreeNode::display(std::ostream& os, unsigned indent) const
+{
+    os << std::string(indent, ' ') << "leaf{";
+    for (auto c : item_.key())
+    {
+        os << strhex(c >> 4);
+        os << strhex(c & 0x0F);
+    }
+    os << "}\n";
+}
+
+void
+SHAMapTreeNode::invariants(bool) const
+{
+}
+
+
+void
+SHAMapAbstractNode::destroy() const noexcept
+{
+    auto pool = pool_;
+    if (isLeaf())
+    {
+        auto leaf = const_cast<SHAMapTreeNode*>(static_cast<SHAMapTreeNode const*>(this));
+        auto const bytes = leaf->bytes();
+        leaf->~SHAMapTreeNode();
+        pool->deallocate(leaf, bytes);
+    }
+    else
+    {
+        auto inner = const_cast<SHAMapInnerNode*>(static_cast<SHAMapInnerNode const*>(this));
+        inner->~SHAMapInnerNode();
+        pool->deallocate(inner, sizeof(SHAMapInnerNode));
+    }
+}
+
+unsigned
+SHAMapInnerNode::max_depth(unsigned parent_depth) const
+{
+    unsigned depth_below_here = 0;
+    for (unsigned i = 0; i < numChildren(); ++i)
+    {
+        if (children()[i] != nullptr)
+            depth_below_here = std::max(depth_below_here, children()[i]->max_depth(0));
+    }
+    return parent_depth + 1 + depth_below_here;
+}
+
+unsigned
+SHAMapTreeNode::max_depth(unsigned parent_depth) const
+{
+    return parent_depth + 1;
+}
+
+unsigned
+SHAMap::max_depth() const
+{
+    return root_->max_depth(0);
+}
+
+std::ostream&
+operator<<(std::ostream& os, SHAMapItem const& x)
+{
+    os << '{';
+    for (auto c : x.tag_)
+    {
+        os << strhex(c >> 4);
+        os << strhex(c & 0x0F);
+    }
+    os << ", ";
+    for (auto c : x.data())
+    {
+        os << strhex(c >> 4);
+        os << strhex(c & 0x0F);
+    }
+    os << '}';
+    return os;
+}
+
+std::ostream&
+operator<<(std::ostream& os, SHAMap const& x)
+{
+    os << "{\n";
+    for (auto const& i : x)
+        os << "    " << i << '\n';
+    os << "}";
+    return os;
+}
+
+void
+SHAMap::display(std::ostream& os) const
+{
+    root_->display(os, 0);
+}
+
+// Each map, and each new generation of a map, gets a distinct cowid
+static
+std::uint32_t
+nextCowid()
+{
+    static std::atomic<std::uint32_t> cowid{1};
+    return cowid++;
+}
+
+SHAMap::SHAMap(std::shared_ptr<SHAMapNodePool> pool)
+    : cowid_{nextCowid()}
+    , pool_{std::move(pool)}
+    , root_{pool_->make<SHAMapInnerNode>(cowid_)}
+{
+}
+
+SHAMap::SHAMap(SHAMapHash const& root, std::shared_ptr<SHAMapNodeStore> store,
+               std::shared_ptr<SHAMapNodePool> pool)
+    : SHAMap{root, std::move(store), std::move(pool), nullptr}
+{
+}
+
+SHAMap::SHAMap(SHAMapHash const& root, std::shared_ptr<SHAMapNodeStore> store,
+               std::shared_ptr<SHAMapNodeCache> cache)
+    : SHAMap{root, std::move(store), cache->pool(), cache}
+{
+}
+
+SHAMap::SHAMap(SHAMapHash const& root, std::shared_ptr<SHAMapNodeStore> store,
+               std::shared_ptr<SHAMapNodePool> pool,
+               std::shared_ptr<SHAMapNodeCache> cache)
+    : cowid_{nextCowid()}
+    , pool_{std::move(pool)}
+    , store_{std::move(store)}
+    , cache_{std::move(cache)}
+{
+    if (root == SHAMapHash{})
+    {
+        root_ = pool_->make<SHAMapInnerNode>(cowid_);
+        return;
+    }
+    root_ = fetchNode(root, cowid_);
+    if (root_->isLeaf() || root_->depth() != 0)
+        throw SHAMapMissingNode(root);
+}
+
+SHAMap::SHAMap(SHAMapHash const& root, Blob const& rootNode,
+               std::shared_ptr<SHAMapNodePool> pool)
+    : cowid_{nextCowid()}
+    , pool_{std::move(pool)}
+{
+    root_ = makeNode(root, rootNode, cowid_);
+    if (root_ == nullptr || root_->isLeaf() || root_->depth() != 0)
+        throw SHAMapMissingNode(root);
+}
+
+SHAMap&
+SHAMap::operator=(SHAMap&& x)
+{
+    // Release the old nodes while their pool is still held
+    root_ = nullptr;
+    cowid_ = x.cowid_;
+    mutable_ = x.mutable_;
+    pool_ = std::move(x.pool_);
+    store_ = std::move(x.store_);
+    cache_ = std::move(x.cache_);
+    root_ = std::move(x.root_);
+    return *this;
+}
+
+SHAMap::SHAMap(SHAMap const& x, bool isMutable)
+    : cowid_{nextCowid()}
+    , mutable_{isMutable}
+    , pool_{x.pool_}
+    , store_{x.store_}
+    , cache_{x.cache_}
+    , root_{x.root_}
+{
+}
+
+SHAMap
+SHAMap::snapshot()
+{
+    SHAMap r{*this, false};
+    // Every node is now shared with r, so none of them may be written in
+    // place any longer
+    cowid_ = nextCowid();
+    return r;
+}
+
+// Call f(i) for each i in [0, n) using up to threads threads, the calling
+// thread included.  Indices are handed out one at a time so that a thread
+// which draws a small subtree simply goes back for more.  If f throws, no
+// further indices are handed out, and the first exception is rethrown once
+// every thread has finished.  If a thread cannot be started, the others do
+// its share.
+template <class F>
+static
+void
+parallel_for(std::size_t n, unsigned threads, F const& f)
+{
+    std::atomic<std::size_t> next{0};
+    std::mutex mutex;
+    std::exception_ptr error;
+    auto work = [&]
+    {
+        try
+        {
+            for (auto i = next++; i < n; i = next++)
+                f(i);
+        }
+        catch (...)
+        {
+            next = n;
+            std::lock_guard<std::mutex> lock{mutex};
+            if (error == nullptr)
+                error = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    threads = static_cast<unsigned>(std::min<std::size_t>(threads, n));
+    try
+    {
+        workers.reserve(threads);
+        for (unsigned t = 1; t < threads; ++t)
+            workers.emplace_back(work);
+    }
+    catch (std::exception const&)
+    {
+    }
+    work();
+    for (auto& t : workers)
+        t.join();
+    if (error != nullptr)
+        std::rethrow_exception(error);
+}
+
+SHAMapHash const&
+SHAMap::getHash(unsigned threads) const
+{
+    if (!root_->isDirty())
+        return root_->getHash();
+    if (threads <= 1)
+    {
+        root_->updateHash();
+        return root_->getHash();
+    }
+    // Split the dirty part of the tree into independent subtrees.  Starting
+    // from the root, replace dirty inner nodes by their dirty children, level
+    // by level, until there are several subtrees per thread.  The inner nodes
+    // that were split are remembered in top-down order.  Dirty leaves directly
+    // below a split node are left for that node to hash.
+    std::vector<SHAMapInnerNode*> upper{static_cast<SHAMapInnerNode*>(root_.get())};
+    std::vector<SHAMapAbstractNode*> subtrees;
+    auto const wanted = 4 * std::size_t{threads};
+    for (std::size_t level = 0; level < upper.size();)
+    {
+        subtrees.clear();
+        auto const end = upper.size();
+        for (; level < end; ++level)
+        {
+            for (int branch = 0; branch < 16; ++branch)
+            {
+                auto child = upper[level]->getChildPointer(branch);
+                if (child != nullptr && child->isDirty())
+                    subtrees.push_back(child);
+            }
+        }
+        if (subtrees.size() >= wanted)
+            break;
+        for (auto node : subtrees)
+        {
+            if (!node->isLeaf())
+                upper.push_back(static_cast<SHAMapInnerNode*>(node));
+        }
+    }
+    parallel_for(subtrees.size(), threads,
+                 [&](std::size_t i)
+                 {
+                     subtrees[i]->updateHash();
+                 });
+    // Deepest split nodes first, so each sees only clean children
+    for (auto i = upper.rbegin(); i != upper.rend(); ++i)
+        (*i)->updateHash();
+    return root_->getHash();
+}
+
+// Add change to the item count of every inner node on stack that knows its
+// count
+void
+SHAMap::countUp(NodeStack const& stack, int change)
+{
+    for (unsigned i = 0; i < stack.size(); ++i)
+    {
+        auto const node = stack.node(i);
+        if (node->isLeaf())
+            continue;
+        auto const inner = static_cast<SHAMapInnerNode*>(node);
+        if (inner->count() != SHAMapInnerNode::unknownCount)
+            inner->setCount(inner->count() + change);
+    }
+}
+
+// The number of items at or below node, counting (and loading) the children
+// of inner nodes that do not know their count yet
+std::uint64_t
+SHAMap::countBelow(SHAMapAbstractNode* node) const
+{
+    if (node->isLeaf())
+        return 1;
+    auto const inner = static_cast<SHAMapInnerNode*>(node);
+    if (inner->count() == SHAMapInnerNode::unknownCount)
+    {
+        std::uint64_t count = 0;
+        for (int branch = 0; branch < 16; ++branch)
+        {
+            if (!inner->isEmptyBranch(branch))
+                count += countBelow(descendThrow(inner, branch));
+        }
+        inner->setCount(count);
+    }
+    return inner->count();
+}
+
+std::size_t
+SHAMap::size() const
+{
+    return countBelow(root_.get());
+}
+
+std::size_t
+SHAMap::rank(uint256 const& id) const
+{
+    std::size_t r = 0;
+    auto node = root_.get();
+    while (!node->isLeaf())
+    {
+        auto const inner = static_cast<SHAMapInnerNode*>(node);
+        if (!inner->has_common_prefix(id))
+        {
+            // the subtree lies wholly before or wholly after id
+            if (id > inner->common())
+                r += countBelow(inner);
+            return r;
+        }
+        auto const branch = selectBranch(inner->depth(), id);
+        for (int b = 0; b < branch; ++b)
+        {
+            if (!inner->isEmptyBranch(b))
+                r += countBelow(descendThrow(inner, b));
+        }
+        node = descendThrow(inner, branch);
+        if (node == nullptr)
+            return r;
+    }
+    return r + (static_cast<SHAMapTreeNode*>(node)->key() < id);
+}
+
+SHAMap::const_iterator
+SHAMap::nth(std::size_t i) const
+{
+    if (i >= size())
+        return end();
+    NodeStack stack;
+    SHAMapAbstractNode* node = root_.get();
+    stack.push_back(node, -1);
+    while (!node->isLeaf())
+    {
+        auto const inner = static_cast<SHAMapInnerNode*>(node);
+        for (int branch = 0; branch < 16; ++branch)
+        {
+            if (inner->isEmptyBranch(branch))
+                continue;
+            node = descendThrow(inner, branch);
+            auto const count = countBelow(node);
+            if (i < count)
+            {
+                stack.push_back(node, branch);
+                break;
+            }
+            i -= count;
+        }
+    }
+    return const_iterator(this, &static_cast<SHAMapTreeNode*>(node)->peekItem(), stack);
+}
+
+// Mark every inner node on stack dirty, deepest first.  Leaves on the stack
+// are skipped.  Stops at the first node already dirty, since all of its
+// ancestors must be dirty as well.
+void
+SHAMap::dirtyUp(NodeStack const& stack)
+{
+    for (auto i = stack.size(); i > 0; --i)
+    {
+        auto const node = stack.node(i-1);
+        if (node->isLeaf())
+            continue;
+        if (node->isDirty())
+            break;
+        node->setDirty();
+    }
+}
+
+SHAMapItem const*
+SHAMap::peekFirstItem(NodeStack& stack) const
+{
+    assert(stack.empty());
+    auto node = firstBelow(root_.get(), -1, stack);
+    if (!node)
+    {
+        while (!stack.empty())
+            stack.pop_back();
+        return nullptr;
+    }
+    return &node->peekItem();
+}
+
+// Step from the leaf at the top of stack to the next one, resuming the scan
+// of each parent just after the branch that was last followed from it
+SHAMapItem const*
+SHAMap::peekNextItem(NodeStack& stack) const
+{
+    assert(!stack.empty());
+    auto from = stack.branch(stack.size() - 1);
+    stack.pop_back();
+    while (!stack.empty())
+    {
+        auto node = stack.back();
+        assert(!node->isLeaf());
+        auto inner = static_cast<SHAMapInnerNode*>(node);
+        for (auto i = from + 1; i < 16; ++i)
+        {
+            if (!inner->isEmptyBranch(i))
+            {
+                node = descendThrow(inner, i);
+                auto leaf = firstBelow(node, i, stack);
+                if (!leaf)
+                    throw 3;
+                assert(leaf->isLeaf());
+                return &leaf->peekItem();
+            }
+        }
+        from = stack.branch(stack.size() - 1);
+        stack.pop_back();
+    }
+    // must be last item
+    return nullptr;
+}
+
+// Step from the leaf at the top of stack to the one before it, or from the
+// end, where stack is empty, to the last leaf
+SHAMapItem const*
+SHAMap::peekPrevItem(NodeStack& stack) const
+{
+    if (stack.empty())
+    {
+        auto node = lastBelow(root_.get(), -1, stack);
+        if (!node)
+        {
+            while (!stack.empty())
+                stack.pop_back();
+            return nullptr;
+        }
+        return &node->peekItem();
+    }
+    auto from = stack.branch(stack.size() - 1);
+    stack.pop_back();
+    while (!stack.empty())
+    {
+        auto inner = static_cast<SHAMapInnerNode*>(stack.back());
+        for (auto i = from - 1; i >= 0; --i)
+        {
+            if (!inner->isEmptyBranch(i))
+            {
+                auto leaf = lastBelow(descendThrow(inner, i), i, stack);
+                if (!leaf)
+                    throw 3;
+                return &leaf->peekItem();
+            }
+        }
+        from = stack.branch(stack.size() - 1);
+        stack.pop_back();
+    }
+    // must be first item
+    return nullptr;
+}
+
+SHAMapTreeNode*
+SHAMap::lastBelow(SHAMapAbstractNode* node, int branch, NodeStack& stack) const
+{
+    // Return the last item at or below this node, following the highest
+    // non-empty branch of each inner node on the way down
+    stack.push_back(node, branch);
+    if (node->isLeaf())
+        return static_cast<SHAMapTreeNode*>(node);
+    auto inner = static_cast<SHAMapInnerNode*>(node);
+    for (int i = 15; i >= 0;)
+    {
+        if (!inner->isEmptyBranch(i))
+        {
+            node = descendThrow(inner, i);
+            stack.push_back(node, i);
+            if (node->isLeaf())
+                return static_cast<SHAMapTreeNode*>(node);
+            inner = static_cast<SHAMapInnerNode*>(node);
+            i = 15;
+        }
+        else
+            --i;
+    }
+    return nullptr;
+}
+
+SHAMapTreeNode*
+SHAMap::firstBelow(SHAMapAbstractNode* node, int branch, NodeStack& stack) const
+{
+    // Return the first item at or below this node, which hangs from branch
+    // of the node at the top of stack
+    stack.push_back(node, branch);
+    if (node->isLeaf())
+        return static_cast<SHAMapTreeNode*>(node);
+    auto inner = static_cast<SHAMapInnerNode*>(node);
+    for (int i = 0; i < 16;)
+    {
+        if (!inner->isEmptyBranch(i))
+        {
+            node = descendThrow(inner, i);
+            stack.push_back(node, i);
+            if (node->isLeaf())
+                return static_cast<SHAMapTreeNode*>(node);
+            inner = static_cast<SHAMapInnerNode*>(node);
+            i = 0;  // scan all 16 branches of this new node
+        }
+        else
+            ++i;  // scan next branch
+    }
+    return nullptr;
+}
+
+// The node to link into a map for node, which came from a SHAMapNodeCache.
+// A leaf is shared as it is.  An inner node is copied, so that the children
+// a map loads are linked into its own copy: a cached node is read by other
+// maps on other threads, and holds no children that would outlive its
+// eviction.
+static
+SHAMapNodePtr<SHAMapAbstractNode>
+ownCopy(SHAMapNodePool& pool, SHAMapNodePtr<SHAMapAbstractNode> node,
+        std::uint32_t cowid)
+{
+    if (node->isLeaf())
+        return node;
+    return pool.make<SHAMapInnerNode>(*static_cast<SHAMapInnerNode const*>(node.get()),
+                                      cowid);
+}
+
+// Make the node with the given hash from its wire form in data, or return
+// null if data is not that node.  Nodes that go into cache_ may be shared
+// with other maps, so they get cowid 0, which no map has.
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMap::makeNode(SHAMapHash const& hash, Blob const& data, std::uint32_t cowid) const
+{
+    auto node = SHAMapAbstractNode::deserialize(*pool_, cache_ != nullptr ? 0 : cowid,
+                                                data.data(), data.size());
+    if (node == nullptr || node->getHash() != hash)
+        return {};
+    node->setStored();
+    if (cache_ == nullptr)
+        return node;
+    cache_->insert(node);
+    return ownCopy(*pool_, std::move(node), cowid);
+}
+
+// Load the node with the given hash from cache_ or else from store_, or
+// return null if neither has it
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMap::tryFetchNode(SHAMapHash const& hash, std::uint32_t cowid) const
+{
+    if (cache_ != nullptr)
+    {
+        if (auto node = cache_->fetch(hash))
+            return ownCopy(*pool_, std::move(node), cowid);
+    }
+    Blob data;
+    if (store_ == nullptr || !store_->fetch(hash, data))
+        return {};
+    return makeNode(hash, data, cowid);
+}
+
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMap::fetchNode(SHAMapHash const& hash, std::uint32_t cowid) const
+{
+    auto node = tryFetchNode(hash, cowid);
+    if (node == nullptr)
+        throw SHAMapMissingNode(hash);
+    return node;
+}
+
+std::vector<std::pair<SHAMapNodeID, SHAMapHash>>
+SHAMap::getMissingNodes(std::size_t max,
+                        std::function<bool(SHAMapHash const&)> const& filter)
+{
+    std::vector<std::pair<SHAMapNodeID, SHAMapHash>> missing;
+    // Visit the inner nodes in memory breadth first, skipping those already
+    // known to be full below
+    std::vector<SHAMapInnerNode*> visited;
+    auto const root = static_cast<SHAMapInnerNode*>(root_.get());
+    if (!root->isFullBelow())
+        visited.push_back(root);
+    for (std::size_t i = 0; i < visited.size() && missing.size() < max; ++i)
+    {
+        auto const inner = visited[i];
+        for (int branch = 0; branch < 16 && missing.size() < max; ++branch)
+        {
+            if (inner->isEmptyBranch(branch))
+                continue;
+            auto child = inner->getChildPointer(branch);
+            if (child == nullptr)
+            {
+                auto const& hash = inner->getChildHash(branch);
+                if (auto node = tryFetchNode(hash, inner->cowid()))
+                {
+                    child = node.get();
+                    inner->setChild(branch, std::move(node));
+                }
+                else
+                {
+                    if (!filter || filter(hash))
+                    {
+                        auto id = inner->common();
+                        id[inner->depth() / 2] |= inner->depth() % 2 == 0 ?
+                                                  branch << 4 : branch;
+                        missing.emplace_back(SHAMapNodeID{inner->depth() + 1u, id},
+                                             hash);
+                    }
+                    continue;
+                }
+            }
+            if (!child->isLeaf() &&
+                !static_cast<SHAMapInnerNode*>(child)->isFullBelow())
+                visited.push_back(static_cast<SHAMapInnerNode*>(child));
+        }
+    }
+    // Children come after their parents in visited, so going backwards each
+    // node is settled before its parent is looked at.  A node that was never
+    // searched is not full below unless already marked so.
+    for (auto i = visited.rbegin(); i != visited.rend(); ++i)
+    {
+        auto const inner = *i;
+        bool full = true;
+        for (int branch = 0; branch < 16 && full; ++branch)
+        {
+            if (inner->isEmptyBranch(branch))
+                continue;
+            auto child = inner->getChildPointer(branch);
+            full = child != nullptr && (child->isLeaf() ||
+                       static_cast<SHAMapInnerNode*>(child)->isFullBelow());
+        }
+        if (full)
+            inner->setFullBelow();
+    }
+    return missing;
+}
+
+SHAMap::AddNode
+SHAMap::addKnownNode(SHAMapNodeID const& id, Blob const& data)
+{
+    auto const& key = id.getNodeID();
+    if (id.depth() == 0 || id.depth() > 64)
+        return AddNode::invalid;
+    // Find the inner node just above the position
+    auto inner = static_cast<SHAMapInnerNode*>(root_.get());
+    while (true)
+    {
+        if (inner->depth() >= id.depth() || !inner->has_common_prefix(key))
+            return AddNode::invalid;
+        auto const branch = selectBranch(inner->depth(), key);
+        if (inner->isEmptyBranch(branch))
+            return AddNode::invalid;
+        auto const child = inner->getChildPointer(branch);
+        if (inner->depth() + 1 == id.depth())
+        {
+            if (child != nullptr)
+                return AddNode::duplicate;
+            auto node = makeNode(inner->getChildHash(branch), data, inner->cowid());
+            // The hash proves the node is the one the parent refers to, but
+            // do not let a badly built map break the shape of this one
+            if (node == nullptr || node->depth() <= inner->depth() ||
+                !inner->has_common_prefix(node->key()) ||
+                selectBranch(inner->depth(), node->key()) != branch)
+                return AddNode::invalid;
+            inner->setChild(branch, std::move(node));
+            return AddNode::useful;
+        }
+        if (child == nullptr || child->isLeaf())
+            return AddNode::invalid;
+        inner = static_cast<SHAMapInnerNode*>(child);
+    }
+}
+
+// Returns the child of parent at branch, or nullptr if the branch is empty.
+// A child that is not in memory yet is loaded and linked into parent.  It
+// gets the cowid of parent, since it is shared by the same maps.  parent is
+// never a node held by cache_, since only copies of those are linked in.
+SHAMapAbstractNode*
+SHAMap::descendThrow(SHAMapInnerNode* parent, int branch) const
+{
+    auto ret = parent->getChildPointer(branch);
+    if (ret != nullptr || parent->isEmptyBranch(branch))
+        return ret;
+    auto child = fetchNode(parent->getChildHash(branch), parent->cowid());
+    ret = child.get();
+    parent->setChild(branch, std::move(child));
+    return ret;
+}
+
+// If id exists in the SHAMap, or if the search ends on a non-matching leaf node,
+// then a pointer to it is returned.  In this case the stack->back() will contain
+// this leaf node.
+// 
+// Otherwise the search ended on an inner node and id is not in the map.  nullptr
+// is returned.  stack->back() will point to the last inner node searched.  If
+// this inner node has a common_prefix with id, then it has an empty slot where
+// id can or should go.  If this inner node does not have a common_prefix with id
+// then the id would be a child of a parent inner node that does not exist.
+SHAMapTreeNode*
+SHAMap::walkTowardsKey(uint256 const& id, NodeStack* stack) const
+{
+    auto inner = static_cast<SHAMapInnerNode*>(root_.get());
+    if (stack != nullptr)
+    {
+        if (stack->empty())
+            stack->push_back(inner, -1);
+        else
+            inner = static_cast<SHAMapInnerNode*>(stack->back());
+    }
+
+    while (true)
+    {
+        if (!inner->has_common_prefix(id))
+            return nullptr;
+        auto const branch = selectBranch(inner->depth(), id);
+        if (inner->isEmptyBranch (branch))
+            return nullptr;
+
+        auto const node = descendThrow (inner, branch);
+        if (node->isLeaf())
+        {
+            auto const leaf = static_cast<SHAMapTreeNode*>(node);
+            if (stack != nullptr)
+                stack->push_back(leaf, branch);
+            return leaf;
+        }
+        inner = static_cast<SHAMapInnerNode*>(node);
+        if (stack != nullptr)
+            stack->push_back(inner, branch);
+    }
+}
+
+SHAMap::const_iterator
+SHAMap::findKey(uint256 const& id) const
+{
+    NodeStack stack;
+    SHAMapTreeNode* leaf = walkTowardsKey(id, &stack);
+    if (leaf == nullptr || leaf->peekItem().key() != id)
+        return end();
+    return const_iterator(this, &leaf->peekItem(), stack);
+}
+
+void
+SHAMap::findKeys(uint256 const* keys, std::size_t n, SHAMapItem const** out) const
+{
+    // Each lookup alternates between two steps.  With branch < 0, its node
+    // has been prefetched: check it and, for an inner node, prefetch the slot
+    // of the branch to follow.  With branch >= 0, that slot has been
+    // prefetched: read the child and prefetch it.  Each step touches only
+    // memory that the previous step of the same lookup prefetched.  A
+    // finished lookup is replaced at once by the next key.
+    struct Lookup
+    {
+        std::size_t               index;
+        SHAMapAbstractNode const* node;
+        int                       branch;
+    };
+    static constexpr unsigned group = 16;
+    Lookup active[group];
+    std::size_t next = 0;
+    unsigned size = 0;
+    for (; size < group && next < n; ++size, ++next)
+        active[size] = {next, root_.get(), -1};
+    while (size > 0)
+    {
+        for (unsigned i = 0; i < size;)
+        {
+            auto& l = active[i];
+            auto const& key = keys[l.index];
+            bool done = true;
+            SHAMapItem const* result = nullptr;
+            if (l.branch >= 0)
+            {
+                auto const inner = static_cast<SHAMapInnerNode const*>(l.node);
+                l.node = descendThrow(const_cast<SHAMapInnerNode*>(inner), l.branch);
+                l.branch = -1;
+                prefetch(l.node);
+                done = false;
+            }
+            else if (l.node->isLeaf())
+            {
+                auto const& item = static_cast<SHAMapTreeNode const*>(l.node)->peekItem();
+                if (item.key() == key)
+                    result = &item;
+            }
+            else
+            {
+                auto const inner = static_cast<SHAMapInnerNode const*>(l.node);
+                auto const branch = selectBranch(inner->depth(), key);
+                if (inner->has_common_prefix(key) && !inner->isEmptyBranch(branch))
+                {
+                    inner->prefetchChild(branch);
+                    l.branch = branch;
+                    done = false;
+                }
+            }
+            if (!done)
+            {
+                ++i;
+                continue;
+            }
+            out[l.index] = result;
+            if (next < n)
+                l = {next++, root_.get(), -1};
+            else
+                l = active[--size];
+        }
+    }
+}
+
+SHAMap::const_iterator
+SHAMap::lower_bound(uint256 const& id) const
+{
+    return bound(id, true);
+}
+
+SHAMap::const_iterator
+SHAMap::upper_bound(uint256 const& id) const
+{
+    return bound(id, false);
+}
+
+SHAMap::const_iterator
+SHAMap::bound(uint256 const& id, bool inclusive) const
+{
+    // Get a const_iterator to the first item in the tree after a given item,
+    // or at it if inclusive.  item need not be in tree
+    NodeStack stack;
+    walkTowardsKey(id, &stack);
+    while (!stack.empty())
+    {
+        auto node = stack.back();
+        if (node->isLeaf())
+        {
+            auto leaf = static_cast<SHAMapTreeNode*>(node);
+            if (leaf->peekItem().key() > id ||
+                (inclusive && leaf->peekItem().key() == id))
+                return const_iterator(this, &leaf->peekItem(), stack);
+        }
+        else
+        {
+            auto inner = static_cast<SHAMapInnerNode*>(node);
+            int i = 0;
+            if (inner->has_common_prefix(id))
+                i = selectBranch(inner->depth(), id) + 1;
+            else if (id > inner->common())
+                i = 16;
+            for (; i < 16; ++i)
+            {
+                if (!inner->isEmptyBranch(i))
+                {
+                    node = descendThrow(inner, i);
+                    auto leaf = firstBelow(node, i, stack);
+                    if (!leaf)
+                        throw 4;
+                    return const_iterator(this, &leaf->peekItem(), stack);
+                }
+            }
+        }
+        stack.pop_back();
+    }
+    return end();
+}
+
+SHAMap::const_iterator
+SHAMap::predecessor(uint256 const& id) const
+{
+    // The mirror image of bound: back up from where the search for id ends
+    // to the first subtree lying wholly before id, and take its last item
+    NodeStack stack;
+    walkTowardsKey(id, &stack);
+    while (!stack.empty())
+    {
+        auto node = stack.back();
+        if (node->isLeaf())
+        {
+            auto leaf = static_cast<SHAMapTreeNode*>(node);
+            if (leaf->peekItem().key() < id)
+                return const_iterator(this, &leaf->peekItem(), stack);
+        }
+        else
+        {
+            auto inner = static_cast<SHAMapInnerNode*>(node);
+            int i = 15;
+            if (inner->has_common_prefix(id))
+                i = selectBranch(inner->depth(), id) - 1;
+            else if (id < inner->common())
+                i = -1;
+            for (; i >= 0; --i)
+            {
+                if (!inner->isEmptyBranch(i))
+                {
+                    auto leaf = lastBelow(descendThrow(inner, i), i, stack);
+                    if (!leaf)
+                        throw 4;
+                    return const_iterator(this, &leaf->peekItem(), stack);
+                }
+            }
+        }
+        stack.pop_back();
+    }
+    return end();
+}
+
+std::vector<Blob>
+SHAMap::getProofPath(uint256 const& key) const
+{
+    std::vector<Blob> path;
+    if (getHash() == SHAMapHash{})
+        return path;
+    NodeStack stack;
+    walkTowardsKey(key, &stack);
+    path.resize(stack.size());
+    for (std::size_t i = 0; i < stack.size(); ++i)
+        stack.node(i)->serialize(path[i]);
+    return path;
+}
+
+SHAMapProof
+verifyProofPath(SHAMapHash const& root, uint256 const& key,
+                std::vector<Blob> const& path)
+{
+    if (path.empty())
+        return root == SHAMapHash{} ? SHAMapProof::excluded : SHAMapProof::invalid;
+    // Each node must have the hash that its parent, or the root hash, gives
+    // it.  Every node but the last must lead on towards key.
+    SHAMapHash expected = root;
+    for (std::size_t i = 0; i < path.size(); ++i)
+    {
+        auto const& node = path[i];
+        bool const last = i + 1 == path.size();
+        SHA512HalfHasher h;
+        h(node.data(), node.size());
+        if (h.finish() != expected)
+            return SHAMapProof::invalid;
+        if (node.size() >= sizeof(leafNodePrefix) + key.size() &&
+            std::equal(std::begin(leafNodePrefix), std::end(leafNodePrefix), node.begin()))
+        {
+            if (!last)
+                return SHAMapProof::invalid;
+            auto const k = node.begin() + sizeof(leafNodePrefix);
+            return std::equal(key.begin(), key.end(), k) ? SHAMapProof::included
+                                                         : SHAMapProof::excluded;
+        }
+        auto const header = sizeof(innerNodePrefix) + 1;
+        if (node.size() < header ||
+            !std::equal(std::begin(innerNodePrefix), std::end(innerNodePrefix), node.begin()))
+            return SHAMapProof::invalid;
+        unsigned const depth = node[sizeof(innerNodePrefix)];
+        std::size_t const bytes = (depth + 1) / 2;
+        if (depth >= 64 || node.size() < header + bytes + 2)
+            return SHAMapProof::invalid;
+        uint256 common{};
+        std::copy(node.begin() + header, node.begin() + header + bytes, common.begin());
+        std::uint16_t const isBranch = node[header + bytes] << 8 | node[header + bytes + 1];
+        auto const hashes = header + bytes + 2;
+        if (node.size() != hashes + std::bitset<16>(isBranch).count() * sizeof(SHAMapHash))
+            return SHAMapProof::invalid;
+        auto const branch = selectBranch(depth, key);
+        if (commonNibbles(common, key) < depth || (isBranch & (1u << branch)) == 0)
+            return last ? SHAMapProof::excluded : SHAMapProof::invalid;
+        if (last)
+            return SHAMapProof::invalid;
+        auto const slot = std::bitset<16>(isBranch & ((1u << branch) - 1)).count();
+        auto const p = node.begin() + hashes + slot * sizeof(SHAMapHash);
+        std::copy(p, p + sizeof(SHAMapHash), expected.begin());
+    }
+    return SHAMapProof::invalid;
+}
+
+void
+SHAMap::assign(std::vector<SHAMapItem const*> const& items, bool hash)
+{
+    if (!mutable_)
+        throw std::logic_error("SHAMap::assign: map is immutable");
+    for (std::size_t i = 1; i < items.size(); ++i)
+    {
+        if (!(items[i-1]->key() < items[i]->key()))
+            throw std::invalid_argument("SHAMap::assign: keys not strictly increasing");
+    }
+    auto root = pool_->make<SHAMapInnerNode>(cowid_);
+    fillInner(*root, items.data(), items.data() + items.size(), hash);
+    root_ = std::move(root);
+}
+
+// Build the subtree holding the sorted, non-empty range [first, last)
+SHAMapNodePtr<SHAMapAbstractNode>
+SHAMap::buildSubtree(SHAMapItem const* const* first, SHAMapItem const* const* last,
+                     bool hash)
+{
+    if (last - first == 1)
+    {
+        auto leaf = SHAMapTreeNode::make(*pool_, cowid_, **first);
+        if (hash)
+            leaf->updateHash();
+        return leaf;
+    }
+    // The range is sorted, so its common prefix is that of its ends
+    auto const& key = (*first)->key();
+    auto const depth = commonNibbles(key, (*(last-1))->key());
+    auto inner = pool_->make<SHAMapInnerNode>(cowid_);
+    inner->set_common(depth, prefix(depth, key));
+    fillInner(*inner, first, last, hash);
+    return inner;
+}
+
+// Give inner, whose depth and prefix are set, a child for each run of
+// [first, last) that shares a branch
+void
+SHAMap::fillInner(SHAMapInnerNode& inner, SHAMapItem const* const* first,
+                  SHAMapItem const* const* last, bool hash)
+{
+    auto const depth = inner.depth();
+    SHAMapItem const* const* runs[17];
+    unsigned n = 0;
+    for (auto i = first; i != last; ++n)
+    {
+        runs[n] = i;
+        auto const branch = selectBranch(depth, (*i)->key());
+        i = std::partition_point(i, last,
+                                 [&](SHAMapItem const* item)
+                                 {
+                                     return selectBranch(depth, item->key()) == branch;
+                                 });
+    }
+    runs[n] = last;
+    inner.reserve(n);
+    for (unsigned r = 0; r < n; ++r)
+    {
+        inner.setChild(selectBranch(depth, (*runs[r])->key()),
+                       buildSubtree(runs[r], runs[r+1], hash));
+    }
+    inner.setCount(last - first);
+    if (hash)
+        inner.updateHash();
+}
+
+// Make every inner node on stack owned by this map, cloning those that are
+// shared with another map.  Each clone is linked into its (already owned)
+// parent and replaces the original on stack.
+void
+SHAMap::unshare(NodeStack& stack)
+{
+    for (unsigned i = 0; i < stack.size(); ++i)
+    {
+        auto const node = stack.node(i);
+        if (node->isLeaf() || node->cowid() == cowid_)
+            continue;
+        auto clone = pool_->make<SHAMapInnerNode>(
+            *static_cast<SHAMapInnerNode const*>(node), cowid_);
+        stack.replace(i, clone.get());
+        if (i == 0)
+            root_ = std::move(clone);
+        else
+            static_cast<SHAMapInnerNode*>(stack.node(i-1))->setChild(stack.branch(i),
+                                                                     std::move(clone));
+    }
+}
+
+bool
+SHAMap::insert(SHAMapItem const& item)
+{
+    NodeStack stack;
+    return insertItem(stack, item.key(), item);
+}
+
+bool
+SHAMap::insert(SHAMapItem&& item)
+{
+    NodeStack stack;
+    return insertItem(stack, item.key(), std::move(item));
+}
+
+bool
+SHAMap::emplace(uint256 const& key, Blob&& data)
+{
+    NodeStack stack;
+    return insertItem(stack, key, key, std::move(data));
+}
+
+SHAMap::const_iterator
+SHAMap::insert(const_iterator hint, SHAMapItem const& item)
+{
+    auto stack = hintStack(hint, item.key());
+    insertItem(stack, item.key(), item);
+    return const_iterator(this, &static_cast<SHAMapTreeNode*>(stack.back())->peekItem(),
+                          stack);
+}
+
+SHAMap::const_iterator
+SHAMap::insert(const_iterator hint, SHAMapItem&& item)
+{
+    auto stack = hintStack(hint, item.key());
+    insertItem(stack, item.key(), std::move(item));
+    return const_iterator(this, &static_cast<SHAMapTreeNode*>(stack.back())->peekItem(),
+                          stack);
+}
+
+// The path of hint cut back to the deepest inner node whose prefix key
+// shares, which is on the path to key.  The path of end() is empty.
+//
+// Changes made since hint was obtained may have put new nodes on its path,
+// or replaced or freed nodes on it, so first the path is cut back to the
+// part still in the tree: its nodes must each be the child of the one above
+// in the branch recorded for it, starting from the root.  Only nodes found
+// to be in the tree are read.
+SHAMap::NodeStack
+SHAMap::hintStack(const_iterator const& hint, uint256 const& key) const
+{
+    assert(hint.map_ == this);
+    auto stack = hint.stack_;
+    unsigned valid = 0;
+    if (!stack.empty() && stack.node(0) == root_.get())
+    {
+        for (valid = 1; valid < stack.size(); ++valid)
+        {
+            auto const parent = stack.node(valid-1);
+            if (parent->isLeaf() ||
+                static_cast<SHAMapInnerNode*>(parent)->getChildPointer(stack.branch(valid)) !=
+                    stack.node(valid))
+                break;
+        }
+    }
+    while (stack.size() > valid)
+        stack.pop_back();
+    while (stack.size() > 1 &&
+           (stack.back()->isLeaf() ||
+            !static_cast<SHAMapInnerNode*>(stack.back())->has_common_prefix(key)))
+        stack.pop_back();
+    return stack;
+}
+
+// Insert a leaf with the given key, made by SHAMapTreeNode::make from leaf
+// only once the key is known to be absent, so that nothing is copied or
+// moved from leaf otherwise.  The search for the key resumes from the inner
+// node at the back of stack, if there is one, and stack is left holding the
+// path to the leaf with the key.
+template <class... Leaf>
+bool
+SHAMap::insertItem(NodeStack& stack, uint256 key, Leaf&&... leaf)
+{
+    if (!mutable_)
+        throw std::logic_error("SHAMap::insert: map is immutable");
+    walkTowardsKey(key, &stack);
+    auto node = stack.back();
     if (node->isLeaf())
     {
-        auto n = std::static_pointer_cast<SHAMapTreeNode>(node);
-        stack.push_back({n, {64, n->peekItem()->key()}});
-        return n.get();
+        // At leaf.  If this is not a duplicate,
+        //   need to create new inner node and insert current leaf and new leaf under it
+        auto const old = static_cast<SHAMapTreeNode*>(node);
+        if (key != old->peekItem().key())
+        {
+            stack.pop_back();
+            unshare(stack);
+            auto inner = pool_->make<SHAMapInnerNode>(cowid_);
+            inner->setChildren(SHAMapNodePtr<SHAMapTreeNode>{old},
+                               SHAMapTreeNode::make(*pool_, cowid_,
+                                                    std::forward<Leaf>(leaf)...));
+            assert(!stack.empty());
+            auto parent = static_cast<SHAMapInnerNode*>(stack.back());
+            auto branch = selectBranch(parent->depth(), key);
+            auto const below = inner.get();
+            parent->setChild(branch, std::move(inner));
+            dirtyUp(stack);
+            countUp(stack, 1);
+            stack.push_back(below, branch);
+            branch = selectBranch(below->depth(), key);
+            stack.push_back(below->getChildPointer(branch), branch);
+            return true;
+        }
+        return false;
+    }
+
+    auto inner = static_cast<SHAMapInnerNode*>(node);
+    if (inner->has_common_prefix(key))
+    {
+        unshare(stack);
+        inner = static_cast<SHAMapInnerNode*>(stack.back());
+        auto depth = inner->depth();
+        auto branch = selectBranch(depth, key);
+        assert(inner->isEmptyBranch(branch));
+        // place new leaf here
+        inner->setChild(branch, SHAMapTreeNode::make(*pool_, cowid_,
+                                                     std::forward<Leaf>(leaf)...));
+        dirtyUp(stack);
+        countUp(stack, 1);
+        stack.push_back(inner->getChildPointer(branch), branch);
+        return true;
+    }
+    else
+    {
+        // Create new inner node and place old inner node and new leaf below it
+        stack.pop_back();
+        assert(!stack.empty());
+        unshare(stack);
+        auto parent = static_cast<SHAMapInnerNode*>(stack.back());
+        auto parent_depth = parent->depth();
+        auto depth = inner->get_common_prefix(key);
+        auto new_inner = pool_->make<SHAMapInnerNode>(cowid_);
+        new_inner->setChild(selectBranch(depth, inner->common()),
+                            SHAMapNodePtr<SHAMapAbstractNode>{inner});
+        new_inner->setChild(selectBranch(depth, key),
+                            SHAMapTreeNode::make(*pool_, cowid_, std::forward<Leaf>(leaf)...));
+        new_inner->set_common(depth, prefix(depth, key));
+        new_inner->setCount(inner->count() == SHAMapInnerNode::unknownCount ?
+                            SHAMapInnerNode::unknownCount : inner->count() + 1);
+        auto const below = new_inner.get();
+        parent->setChild(selectBranch(parent_depth, key), std::move(new_inner));
+        dirtyUp(stack);
+        countUp(stack, 1);
+        stack.push_back(below, selectBranch(parent_depth, key));
+        stack.push_back(below->getChildPointer(selectBranch(depth, key)),
+                        selectBranch(depth, key));
+        return true;
     }
-    auto inner = std::static_pointer_cast<SHAMapInnerNode>(node);
-    stack.push_back({inner, {inner->depth(), inner->common()}});
-    for (int i = 0; i < 16;)
+}
+
+std::size_t
+SHAMap::insertParallel(std::vector<SHAMapItem const*>& items, unsigned threads)
+{
+    if (!mutable_)
+        throw std::logic_error("SHAMap::insert_parallel: map is immutable");
+    if (threads <= 1)
     {
-        if (!inner->isEmptyBranch(i))
+        std::size_t added = 0;
+        for (auto item : items)
         {
-            node = descendThrow(inner, i);
-            assert(!stack.empty());
-            if (node->isLeaf())
+            NodeStack stack;
+            added += insertItem(stack, item->key(), *item);
+        }
+        return added;
+    }
+    // A task inserts its items into the subtree below branch of parent.
+    // Tasks share no nodes, and only the inner nodes that were split into
+    // tasks, all owned by this map, are written once the tasks are done.
+    struct Task
+    {
+        SHAMapInnerNode*                  parent;
+        int                               branch;
+        std::vector<SHAMapItem const*>    items;
+        SHAMapNodePtr<SHAMapAbstractNode> subtree;
+        std::size_t                       added;
+    };
+    if (root_->cowid() != cowid_)
+        root_ = pool_->make<SHAMapInnerNode>(
+            *static_cast<SHAMapInnerNode const*>(root_.get()), cowid_);
+    auto const wanted = items.size() / (4 * std::size_t{threads}) + 1;
+    std::vector<std::pair<SHAMapInnerNode*, std::vector<SHAMapItem const*>>> split;
+    split.emplace_back(static_cast<SHAMapInnerNode*>(root_.get()), std::move(items));
+    std::vector<Task> tasks;
+    for (std::size_t s = 0; s < split.size(); ++s)
+    {
+        auto const parent = split[s].first;
+        std::vector<SHAMapItem const*> buckets[16];
+        for (auto item : split[s].second)
+            buckets[selectBranch(parent->depth(), item->key())].push_back(item);
+        split[s].second.clear();
+        for (int branch = 0; branch < 16; ++branch)
+        {
+            auto& bucket = buckets[branch];
+            if (bucket.empty())
+                continue;
+            auto child = parent->isEmptyBranch(branch) ? nullptr :
+                                                         descendThrow(parent, branch);
+            if (bucket.size() > wanted && child != nullptr && !child->isLeaf())
             {
-                auto n = std::static_pointer_cast<SHAMapTreeNode>(node);
-                stack.push_back({n, {64, n->peekItem()->key()}});
-                return n.get();
+                auto inner = static_cast<SHAMapInnerNode*>(child);
+                if (std::all_of(bucket.begin(), bucket.end(),
+                                [inner](SHAMapItem const* item)
+                                {return inner->has_common_prefix(item->key());}))
+                {
+                    if (inner->cowid() != cowid_)
+                    {
+                        auto clone = pool_->make<SHAMapInnerNode>(*inner, cowid_);
+                        inner = clone.get();
+                        parent->setChild(branch, std::move(clone));
+                    }
+                    split.emplace_back(inner, std::move(bucket));
+                    continue;
+                }
             }
-            inner = std::static_pointer_cast<SHAMapInnerNode>(node);
-            stack.push_back({inner, {inner->depth(), inner->common()}});
-            i = 0;  // scan all 16 branches of this new node
+            tasks.push_back(Task{parent, branch, std::move(bucket), nullptr, 0});
         }
-        else
-            ++i;  // scan next branch
     }
-    return nullptr;
+    // Hand out the largest tasks first.  If a task fails, the subtrees of
+    // the tasks, as far as each got, are still linked in and the split nodes
+    // brought up to date before the exception is passed on, since inserting
+    // leaves the subtree of a task consistent after each item.
+    std::sort(tasks.begin(), tasks.end(),
+              [](Task const& x, Task const& y) {return x.items.size() > y.items.size();});
+    auto const insertTask = [this, &tasks](std::size_t i)
+    {
+        // Insert through a map whose root stands in for task.parent but
+        // holds only the task's branch, and which writes in place the nodes
+        // this map owns
+        auto& task = tasks[i];
+        // Every node of the task is allocated from the shared pool
+        SHAMapNodePool::ThreadCache cache{*pool_};
+        SHAMap sub{*this, true};
+        sub.cowid_ = cowid_;
+        auto top = pool_->make<SHAMapInnerNode>(cowid_);
+        top->set_common(task.parent->depth(), task.parent->common());
+        if (!task.parent->isEmptyBranch(task.branch))
+            top->setChild(task.branch, task.parent->getChild(task.branch));
+        sub.root_ = top;
+        try
+        {
+            for (auto item : task.items)
+            {
+                NodeStack stack;
+                task.added += sub.insertItem(stack, item->key(), *item);
+            }
+        }
+        catch (...)
+        {
+            task.subtree = top->getChild(task.branch);
+            throw;
+        }
+        task.subtree = top->getChild(task.branch);
+    };
+    std::exception_ptr error;
+    try
+    {
+        parallel_for(tasks.size(), threads, insertTask);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    std::size_t added = 0;
+    for (auto& task : tasks)
+    {
+        if (task.added != 0)
+            task.parent->setChild(task.branch, std::move(task.subtree));
+        added += task.added;
+    }
+    // Bring the counts and dirty flags of the split nodes up to date, bottom up
+    for (auto s = split.size(); s-- > 0;)
+    {
+        auto const inner = split[s].first;
+        std::uint64_t count = 0;
+        bool dirty = false;
+        for (int branch = 0; branch < 16; ++branch)
+        {
+            if (inner->isEmptyBranch(branch))
+                continue;
+            auto const child = inner->getChildPointer(branch);
+            if (child == nullptr)
+                count = SHAMapInnerNode::unknownCount;
+            else
+            {
+                dirty = dirty || child->isDirty();
+                auto const n = child->isLeaf() ? 1 :
+                               static_cast<SHAMapInnerNode*>(child)->count();
+                if (n == SHAMapInnerNode::unknownCount)
+                    count = n;
+                else if (count != SHAMapInnerNode::unknownCount)
+                    count += n;
+            }
+        }
+        inner->setCount(count);
+        if (dirty)
+            inner->setDirty();
+    }
+    if (error != nullptr)
+        std::rethrow_exception(error);
+    return added;
+}
+
+SHAMap::const_iterator
+SHAMap::erase(const_iterator i)
+{
+    if (!mutable_)
+        throw std::logic_error("SHAMap::erase: map is immutable");
+    assert(i.map_ == this);
+    auto ci = i.stack_.size() - 1;
+    assert(ci >= 1);
+    unshare(i.stack_);
+    dirtyUp(i.stack_);
+    countUp(i.stack_, -1);
+    auto pi = ci - 1;
+    auto parent = static_cast<SHAMapInnerNode*>(i.stack_.node(pi));
+    auto branch = i.stack_.branch(ci);
+    parent->setChild(branch, nullptr);
+    if (parent->numChildren() == 1 && parent->depth() > 0)
+    {
+        assert(ci >= 2);
+        auto const depth = parent->depth();
+        auto grand_parent = static_cast<SHAMapInnerNode*>(i.stack_.node(pi-1));
+        auto next_branch = i.stack_.branch(pi);
+        auto only_child = collapse(grand_parent, next_branch, parent);
+        auto child_branch = selectBranch(depth, only_child->key());
+        // parent is gone; only_child now hangs from next_branch
+        i.stack_.pop_back();
+        i.stack_.pop_back();
+        if (child_branch > branch)
+        {
+            i.item_ = &firstBelow(only_child, next_branch, i.stack_)->peekItem();
+            return i;
+        }
+        // the next item follows only_child in grand_parent
+        i.stack_.push_back(only_child, next_branch);
+    }
+    i.item_ = i.map_->peekNextItem(i.stack_);
+    return i;
 }
 
+bool
+SHAMap::erase(uint256 const& key)
+{
+    if (!mutable_)
+        throw std::logic_error("SHAMap::erase: map is immutable");
+    NodeStack stack;
+    auto const leaf = walkTowardsKey(key, &stack);
+    if (leaf == nullptr || leaf->key() != key)
+        return false;
+    auto const ci = stack.size() - 1;
+    unshare(stack);
+    dirtyUp(stack);
+    countUp(stack, -1);
+    auto parent = static_cast<SHAMapInnerNode*>(stack.node(ci-1));
+    parent->setChild(stack.branch(ci), nullptr);
+    if (parent->numChildren() == 1 && parent->depth() > 0)
+        collapse(static_cast<SHAMapInnerNode*>(stack.node(ci-2)), stack.branch(ci-1), parent);
+    return true;
+}
+
+// Replace inner, which hangs from branch of parent and has at most one child
+// left, by that child, or remove it if it has none.  parent must be owned by
+// this map.  Returns the child, if any.
 SHAMapAbstractNode*
-SHAMap::descendThrow(SHAMapInnerNode* parent, int branch) const
+SHAMap::collapse(SHAMapInnerNode* parent, int branch, SHAMapInnerNode* inner)
 {
-    auto ret = parent->getChildPointer(branch);
-    if (ret == nullptr && !parent->isEmptyBranch(branch))
-        throw 1;
-    return ret;
+    assert(inner->numChildren() <= 1);
+    SHAMapNodePtr<SHAMapAbstractNode> child;
+    if (inner->numChildren() == 1)
+    {
+        // the remaining child may not be loaded yet
+        for (int b = 0; b < 16 && child == nullptr; ++b)
+            child = SHAMapNodePtr<SHAMapAbstractNode>{descendThrow(inner, b)};
+    }
+    auto const r = child.get();
+    // this may destroy inner, but not child
+    parent->setChild(branch, std::move(child));
+    return r;
 }
 
-std::shared_ptr<SHAMapAbstractNode>
-SHAMap::descendThrow(std::shared_ptr<SHAMapInnerNode> parent, int branch) const
+std::size_t
+SHAMap::erase_batch(uint256 const* keys, std::size_t n)
 {
-    auto ret = parent->getChild(branch);
-    if (ret == nullptr && !parent->isEmptyBranch(branch))
-        throw 2;
-    return ret;
+    if (!mutable_)
+        throw std::logic_error("SHAMap::erase_batch: map is immutable");
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        if (!(keys[i-1] < keys[i]))
+            throw std::invalid_argument("SHAMap::erase_batch: keys not strictly increasing");
+    }
+    if (n == 0)
+        return 0;
+    NodeStack stack;
+    stack.push_back(root_.get(), -1);
+    return eraseBelow(stack, keys, keys + n);
 }
 
-// If id exists in the SHAMap, or if the search ends on a non-matching leaf node,
-// then a pointer to it is returned.  In this case the stack->back() will contain
-// this leaf node.
-// 
-// Otherwise the search ended on an inner node and id is not in the map.  nullptr
-// is returned.  stack->back() will point to the last inner node searched.  If
-// this inner node has a common_prefix with id, then it has an empty slot where
-// id can or should go.  If this inner node does not have a common_prefix with id
-// then the id would be a child of a parent inner node that does not exist.
-SHAMapTreeNode*
-SHAMap::walkTowardsKey(uint256 const& id, NodeStack* stack) const
+// Erase the sorted keys [first, last), which all share the prefix of the
+// inner node at the back of stack, from below that node, and return the
+// number erased.  stack is the path down to the node from the root.  Nodes
+// on the path that are shared with a snapshot are cloned only once a key is
+// found, and replace the originals on stack.  Each child is finished with
+// all of its keys before it is collapsed.
+std::size_t
+SHAMap::eraseBelow(NodeStack& stack, uint256 const* first, uint256 const* last)
+{
+    // A deeper call may replace the node with a clone
+    auto const level = stack.size() - 1;
+    auto inner = [&stack, level]
+                 {return static_cast<SHAMapInnerNode*>(stack.node(level));};
+    std::size_t erased = 0;
+    while (first != last)
+    {
+        // The keys are sorted, so those under one branch form a run
+        auto const depth = inner()->depth();
+        auto const branch = selectBranch(depth, *first);
+        auto end = first + 1;
+        while (end != last && selectBranch(depth, *end) == branch)
+            ++end;
+        auto child = inner()->isEmptyBranch(branch) ? nullptr
+                                                    : descendThrow(inner(), branch);
+        if (child != nullptr && child->isLeaf())
+        {
+            if (std::binary_search(first, end, child->key()))
+            {
+                if (inner()->cowid() != cowid_)
+                    unshare(stack);
+                inner()->setChild(branch, nullptr);
+                ++erased;
+            }
+        }
+        else if (child != nullptr)
+        {
+            // Only the keys sharing the child's prefix can be below it
+            auto const below = static_cast<SHAMapInnerNode*>(child);
+            auto const shares = [below](uint256 const& key)
+                                {return below->has_common_prefix(key);};
+            auto const b = std::find_if(first, end, shares);
+            auto const e = std::find_if_not(b, end, shares);
+            if (b != e)
+            {
+                stack.push_back(below, branch);
+                auto const n = eraseBelow(stack, b, e);
+                auto const after = static_cast<SHAMapInnerNode*>(stack.back());
+                stack.pop_back();
+                erased += n;
+                if (n != 0 && after->numChildren() <= 1)
+                    collapse(inner(), branch, after);
+            }
+        }
+        first = end;
+    }
+    if (erased != 0)
+    {
+        inner()->setDirty();
+        if (inner()->count() != SHAMapInnerNode::unknownCount)
+            inner()->setCount(inner()->count() - erased);
+    }
+    return erased;
+}
+
+void
+SHAMap::save(SHAMapNodeStore& store) const
+{
+    if (getHash() == SHAMapHash{})
+        return;
+    std::vector<SHAMapAbstractNode*> todo{root_.get()};
+    Blob data;
+    while (!todo.empty())
+    {
+        auto node = todo.back();
+        todo.pop_back();
+        data.clear();
+        node->serialize(data);
+        store.store(node->getHash(), data);
+        if (node->isLeaf())
+            continue;
+        auto inner = static_cast<SHAMapInnerNode*>(node);
+        for (int branch = 0; branch < 16; ++branch)
+        {
+            if (auto child = inner->getChildPointer(branch))
+                todo.push_back(child);
+        }
+    }
+}
+
+void
+SHAMap::unload()
+{
+    if (!mutable_)
+        throw std::logic_error("SHAMap::unload: map is immutable");
+    if (root_->cowid() == cowid_)
+        unloadBelow(static_cast<SHAMapInnerNode*>(root_.get()));
+}
+
+// Unload what can be unloaded below inner, which this map owns, children
+// first, and return true if none of its children is left in memory
+bool
+SHAMap::unloadBelow(SHAMapInnerNode* inner)
+{
+    bool empty = true;
+    for (int branch = 0; branch < 16; ++branch)
+    {
+        auto const child = inner->getChildPointer(branch);
+        if (child == nullptr)
+            continue;
+        // A child another map shares may hold children that map still uses
+        bool const below = child->isLeaf() ||
+                           (child->cowid() == cowid_ &&
+                            unloadBelow(static_cast<SHAMapInnerNode*>(child)));
+        if (below && child->isStored() && !child->isDirty())
+            inner->unloadChild(branch);
+        else
+            empty = false;
+    }
+    return empty;
+}
+
+// Report the differences between the subtree mine, from this map, and the
+// subtree theirs, from other.  Either may be null.  A node covers the keys
+// sharing its first depth() nibbles with its key(), and a leaf covers just
+// its own key.  With path compression the two nodes need not be at the same
+// depth.  If one covers a wider range than the other, the narrower node is
+// matched against the one branch of the wider node whose range holds it, and
+// every other branch of the wider node is unmatched.
+void
+SHAMap::diff(SHAMap const& other, SHAMapAbstractNode* mine,
+             SHAMapAbstractNode* theirs, DiffVisitor const& visitor) const
+{
+    if (mine == theirs)
+        return;
+    if (mine == nullptr || theirs == nullptr)
+    {
+        // Every item below the one node present is unmatched
+        auto node = mine != nullptr ? mine : theirs;
+        if (node->isLeaf())
+        {
+            auto item = &static_cast<SHAMapTreeNode*>(node)->peekItem();
+            visitor(mine != nullptr ? item : nullptr,
+                    theirs != nullptr ? item : nullptr);
+            return;
+        }
+        auto inner = static_cast<SHAMapInnerNode*>(node);
+        auto const& owner = mine != nullptr ? *this : other;
+        for (int branch = 0; branch < 16; ++branch)
+        {
+            if (inner->isEmptyBranch(branch))
+                continue;
+            auto child = owner.descendThrow(inner, branch);
+            if (mine != nullptr)
+                diff(other, child, nullptr, visitor);
+            else
+                diff(other, nullptr, child, visitor);
+        }
+        return;
+    }
+    if (mine->getHash() == theirs->getHash())
+        return;
+    auto const dm = mine->depth();
+    auto const dt = theirs->depth();
+    auto const depth = std::min(dm, dt);
+    if (commonNibbles(mine->key(), theirs->key()) < depth)
+    {
+        // Disjoint ranges; report the lower one first
+        if (mine->key() < theirs->key())
+        {
+            diff(other, mine, nullptr, visitor);
+            diff(other, nullptr, theirs, visitor);
+        }
+        else
+        {
+            diff(other, nullptr, theirs, visitor);
+            diff(other, mine, nullptr, visitor);
+        }
+        return;
+    }
+    if (depth == 64)
+    {
+        // Two leaves with the same key but different data
+        visitor(&static_cast<SHAMapTreeNode*>(mine)->peekItem(),
+                &static_cast<SHAMapTreeNode*>(theirs)->peekItem());
+        return;
+    }
+    // Split whichever nodes are at depth into their branches.  A node that
+    // is deeper lies entirely within one of those branches.
+    auto const splitMine = dm == depth ? static_cast<SHAMapInnerNode*>(mine) : nullptr;
+    auto const splitTheirs = dt == depth ? static_cast<SHAMapInnerNode*>(theirs) : nullptr;
+    for (int branch = 0; branch < 16; ++branch)
+    {
+        SHAMapAbstractNode* m = mine;
+        SHAMapAbstractNode* t = theirs;
+        if (splitMine != nullptr && splitTheirs != nullptr &&
+            !splitMine->isEmptyBranch(branch) && !splitTheirs->isEmptyBranch(branch) &&
+            splitMine->getChildHash(branch) == splitTheirs->getChildHash(branch))
+            continue;
+        if (splitMine != nullptr)
+            m = descendThrow(splitMine, branch);
+        else if (selectBranch(depth, mine->key()) != branch)
+            m = nullptr;
+        if (splitTheirs != nullptr)
+            t = other.descendThrow(splitTheirs, branch);
+        else if (selectBranch(depth, theirs->key()) != branch)
+            t = nullptr;
+        diff(other, m, t, visitor);
+    }
+}
+
+void
+SHAMap::invariants() const
+{
+    auto node = root_.get();
+    assert(node != nullptr);
+    node->invariants(true);
+}
+
+constexpr std::uint64_t SHAMapPublisher::idle;
+
+SHAMapPublisher::SHAMapPublisher(SHAMap& map, std::size_t readers)
+    : storage_{new unsigned char[(readers + 1) * sizeof(Slot)]}
+    , numSlots_{readers}
+{
+    // read would wait forever for a slot
+    if (readers == 0)
+        throw std::invalid_argument("SHAMapPublisher: no reader slots");
+    void* p = storage_.get();
+    std::size_t space = (readers + 1) * sizeof(Slot);
+    slots_ = static_cast<Slot*>(std::align(alignof(Slot), readers * sizeof(Slot),
+                                           p, space));
+    for (std::size_t i = 0; i < readers; ++i)
+        ::new(slots_ + i) Slot{};
+    map.getHash();
+    map.size();
+    current_.store(new SHAMap{map.snapshot()});
+}
+
+SHAMapPublisher::~SHAMapPublisher()
+{
+    delete current_.load();
+    for (auto const& v : retired_)
+        delete v.first;
+    for (std::size_t i = 0; i < numSlots_; ++i)
+        slots_[i].~Slot();
+}
+
+void
+SHAMapPublisher::publish(SHAMap& map)
+{
+    map.getHash();
+    map.size();
+    std::unique_ptr<SHAMap const> next{new SHAMap{map.snapshot()}};
+    retired_.reserve(retired_.size() + 1);
+    auto const old = current_.exchange(next.release());
+    // A reader that loaded old recorded its epoch before this exchange, so
+    // its epoch is at most the one old is retired in
+    retired_.emplace_back(old, epoch_.fetch_add(1));
+    reclaim();
+}
+
+SHAMapPublisher::Reader
+SHAMapPublisher::read()
+{
+    while (true)
+    {
+        auto const epoch = epoch_.load();
+        for (std::size_t i = 0; i < numSlots_; ++i)
+        {
+            auto expected = idle;
+            if (slots_[i].epoch.compare_exchange_strong(expected, epoch))
+                return Reader{&slots_[i], current_.load()};
+        }
+        // Every slot is pinned; let their readers run and try again
+        std::this_thread::yield();
+    }
+}
+
+// Destroy the retired versions whose epoch is earlier than that of every
+// pinned reader
+void
+SHAMapPublisher::reclaim()
+{
+    auto oldest = idle;
+    for (std::size_t i = 0; i < numSlots_; ++i)
+        oldest = std::min(oldest, slots_[i].epoch.load());
+    std::size_t kept = 0;
+    for (auto const& v : retired_)
+    {
+        if (v.second < oldest)
+            delete v.first;
+        else
+            retired_[kept++] = v;
+    }
+    retired_.resize(kept);
+}
+
+// The SHAMapMapped layout
+
+static unsigned char const mappedMagic[8] = {'S', 'H', 'A', 'M', 'A', 'P', 'M', '1'};
+// The file header, and the part of a node before its child offsets or data
+static constexpr std::size_t mappedFileHeader = 16;
+static constexpr std::size_t mappedNodeHeader = 72;
+
+static
+void
+storeLE(unsigned char* p, std::uint64_t x, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; ++i, x >>= 8)
+        p[i] = static_cast<unsigned char>(x);
+}
+
+static
+std::uint64_t
+loadLE(unsigned char const* p, unsigned bytes)
+{
+    std::uint64_t x = 0;
+    for (unsigned i = bytes; i > 0; --i)
+        x = x << 8 | p[i-1];
+    return x;
+}
+
+// The size of node in the mapped layout
+static
+std::uint64_t
+mappedNodeBytes(SHAMapAbstractNode const* node)
+{
+    if (node->isLeaf())
+    {
+        auto const size = static_cast<SHAMapTreeNode const*>(node)->peekItem().data().size();
+        return (mappedNodeHeader + size + 7) / 8 * 8;
+    }
+    return mappedNodeHeader +
+           8 * static_cast<SHAMapInnerNode const*>(node)->numChildren();
+}
+
+void
+SHAMap::saveMapped(std::string const& path) const
+{
+    getHash();
+    // Size every subtree first, so that the file can be written strictly in
+    // order with each child offset known before its parent is written
+    std::vector<MappedSize> sizes;
+    if (getHash() != SHAMapHash{})
+        sizeMapped(root_.get(), sizes);
+    std::ofstream out{path, std::ios::binary | std::ios::trunc};
+    if (!out)
+        throw std::runtime_error("SHAMap::saveMapped: cannot open " + path);
+    unsigned char header[mappedFileHeader] = {};
+    std::copy(std::begin(mappedMagic), std::end(mappedMagic), header);
+    if (!sizes.empty())
+        storeLE(header + 8, mappedFileHeader, 8);
+    out.write(reinterpret_cast<char const*>(header), sizeof(header));
+    if (!sizes.empty())
+    {
+        std::size_t index = 0;
+        writeMapped(out, root_.get(), sizes, index);
+    }
+    out.flush();
+    if (!out)
+        throw std::runtime_error("SHAMap::saveMapped: cannot write " + path);
+}
+
+// Append to sizes, in the depth-first order the nodes are written in, the
+// bytes taken by each subtree from node down and the number of nodes in it
+void
+SHAMap::sizeMapped(SHAMapAbstractNode* node, std::vector<MappedSize>& sizes) const
+{
+    auto const index = sizes.size();
+    sizes.push_back({mappedNodeBytes(node), 1});
+    if (node->isLeaf())
+        return;
+    auto const inner = static_cast<SHAMapInnerNode*>(node);
+    for (int branch = 0; branch < 16; ++branch)
+    {
+        if (inner->isEmptyBranch(branch))
+            continue;
+        auto const child = sizes.size();
+        sizeMapped(descendThrow(inner, branch), sizes);
+        sizes[index].bytes += sizes[child].bytes;
+        sizes[index].nodes += sizes[child].nodes;
+    }
+}
+
+// Write node, which is sizes[index], and everything below it, advancing
+// index past them
+void
+SHAMap::writeMapped(std::ostream& out, SHAMapAbstractNode* node,
+                    std::vector<MappedSize> const& sizes, std::size_t& index) const
+{
+    std::vector<unsigned char> buf(mappedNodeHeader);
+    std::copy(node->getHash().begin(), node->getHash().end(), buf.begin() + 8);
+    std::copy(node->key().begin(), node->key().end(), buf.begin() + 40);
+    ++index;
+    if (node->isLeaf())
+    {
+        auto const data = static_cast<SHAMapTreeNode*>(node)->peekItem().data();
+        buf[0] = 1;
+        storeLE(&buf[4], data.size(), 4);
+        buf.insert(buf.end(), data.begin(), data.end());
+        buf.resize(mappedNodeBytes(node));
+        out.write(reinterpret_cast<char const*>(buf.data()), buf.size());
+        return;
+    }
+    auto const inner = static_cast<SHAMapInnerNode*>(node);
+    unsigned bitmap = 0;
+    for (int branch = 0; branch < 16; ++branch)
+    {
+        if (!inner->isEmptyBranch(branch))
+            bitmap |= 1u << branch;
+    }
+    buf[0] = 0;
+    buf[1] = static_cast<unsigned char>(inner->depth());
+    storeLE(&buf[2], bitmap, 2);
+    buf.resize(mappedNodeBytes(node));
+    // The children follow in branch order, each after the whole subtree of
+    // the one before
+    std::uint64_t relative = buf.size();
+    auto p = &buf[mappedNodeHeader];
+    for (auto child = index; p != buf.data() + buf.size(); p += 8)
+    {
+        storeLE(p, relative, 8);
+        relative += sizes[child].bytes;
+        child += sizes[child].nodes;
+    }
+    out.write(reinterpret_cast<char const*>(buf.data()), buf.size());
+    for (int branch = 0; branch < 16; ++branch)
+    {
+        if (!inner->isEmptyBranch(branch))
+            writeMapped(out, descendThrow(inner, branch), sizes, index);
+    }
+}
+
+static
+void
+unmapFile(unsigned char const* base, std::size_t size)
+{
+    if (base == nullptr)
+        return;
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(base);
+#else
+    ::munmap(const_cast<unsigned char*>(base), size);
+#endif
+}
+
+SHAMapMapped::SHAMapMapped(std::string const& path)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0,
+                                                nullptr);
+            if (mapping != nullptr)
+            {
+                base_ = static_cast<unsigned char const*>(
+                    MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                size_ = static_cast<std::size_t>(size.QuadPart);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                base_ = static_cast<unsigned char const*>(p);
+                size_ = static_cast<std::size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+    }
+#endif
+    if (base_ == nullptr)
+        throw std::runtime_error("SHAMapMapped: cannot map " + path);
+    if (size_ < mappedFileHeader ||
+        !std::equal(std::begin(mappedMagic), std::end(mappedMagic), base_))
+    {
+        unmapFile(base_, size_);
+        throw std::runtime_error("SHAMapMapped: not a mapped SHAMap: " + path);
+    }
+    root_ = loadLE(base_ + 8, 8);
+}
+
+SHAMapMapped::~SHAMapMapped()
+{
+    unmapFile(base_, size_);
+}
+
+uint256
+SHAMapMapped::Item::key() const
 {
-    assert(stack == nullptr || stack->empty());
-    auto inNode = root_;
-    if (stack != nullptr)
-        stack->push_back({inNode, {inNode->depth(), inNode->key()}});
+    uint256 r;
+    std::copy(p_ + 40, p_ + 72, r.begin());
+    return r;
+}
 
-    while (!inNode->isLeaf())
-    {
-        auto const inner = std::static_pointer_cast<SHAMapInnerNode>(inNode);
-        if (!inner->has_common_prefix(id))
-            return nullptr;
-        auto const branch = selectBranch(inNode->depth(), id);
-        if (inner->isEmptyBranch (branch))
-            return nullptr;
+std::size_t
+SHAMapMapped::Item::size() const
+{
+    return loadLE(p_ + 4, 4);
+}
 
-        inNode = descendThrow (inner, branch);
-        if (stack != nullptr)
-            stack->push_back({inNode, {inNode->depth(), inNode->key()}});
-    }
-    return static_cast<SHAMapTreeNode*>(inNode.get());
+unsigned char const*
+SHAMapMapped::node(std::uint64_t offset) const
+{
+    if (offset % 8 != 0 || offset < mappedFileHeader || offset > size_ ||
+        size_ - offset < mappedNodeHeader)
+        throw std::runtime_error("SHAMapMapped: bad node offset");
+    auto const p = base_ + offset;
+    std::uint64_t rest;
+    if (p[0] == 0 && p[1] < 64)
+        rest = 8 * std::bitset<16>(loadLE(p + 2, 2)).count();
+    else if (p[0] == 1)
+        rest = loadLE(p + 4, 4);
+    else
+        throw std::runtime_error("SHAMapMapped: bad node");
+    if (size_ - offset - mappedNodeHeader < rest)
+        throw std::runtime_error("SHAMapMapped: truncated node");
+    return p;
 }
 
-SHAMap::const_iterator
-SHAMap::findKey(uint256 const& id) const
+std::uint64_t
+SHAMapMapped::child(std::uint64_t offset, int branch) const
 {
-    NodeStack stack;
-    SHAMapTreeNode* leaf = walkTowardsKey(id, &stack);
-    if (leaf == nullptr || leaf->peekItem()->key() != id)
-        return end();
-    return const_iterator(this, leaf->peekItem().get(), std::move(stack));
+    auto const p = node(offset);
+    auto const bitmap = static_cast<unsigned>(loadLE(p + 2, 2));
+    if ((bitmap & (1u << branch)) == 0)
+        return 0;
+    auto const slot = std::bitset<16>(bitmap & ((1u << branch) - 1)).count();
+    auto const relative = loadLE(p + mappedNodeHeader + 8 * slot, 8);
+    // children follow their parent, which also rules out cycles
+    if (relative == 0 || relative > size_)
+        throw std::runtime_error("SHAMapMapped: bad child offset");
+    return offset + relative;
 }
 
-SHAMap::const_iterator
-SHAMap::upper_bound(uint256 const& id) const
+SHAMapHash
+SHAMapMapped::getHash() const
 {
-    // Get a const_iterator to the next item in the tree after a given item
-    // item need not be in tree
-    NodeStack stack;
-    walkTowardsKey(id, &stack);
-    std::shared_ptr<SHAMapAbstractNode> node;
-    while (!stack.empty())
+    SHAMapHash r{};
+    if (root_ != 0)
     {
-        std::tie(node, std::ignore) = stack.back();
-        if (node->isLeaf())
+        auto const p = node(root_);
+        std::copy(p + 8, p + 40, r.begin());
+    }
+    return r;
+}
+
+// Extend the path of i down to the first leaf below the node at offset
+void
+SHAMapMapped::firstBelow(std::uint64_t offset, const_iterator& i) const
+{
+    while (true)
+    {
+        if (i.size_ == 65)
+            throw std::runtime_error("SHAMapMapped: path too long");
+        i.path_[i.size_++] = offset;
+        auto const p = node(offset);
+        if (p[0] == 1)
         {
-            auto leaf = std::static_pointer_cast<SHAMapTreeNode>(node);
-            if (leaf->peekItem()->key() > id)
-                return const_iterator(this, leaf->peekItem().get(), std::move(stack));
+            i.item_ = Item{p};
+            return;
         }
-        else
+        auto const bitmap = static_cast<unsigned>(loadLE(p + 2, 2));
+        if (bitmap == 0)
+            throw std::runtime_error("SHAMapMapped: empty inner node");
+        offset = child(offset, countTrailingZeros(bitmap));
+    }
+}
+
+void
+SHAMapMapped::next(const_iterator& i) const
+{
+    auto const key = i.item_.key();
+    --i.size_;
+    while (i.size_ > 0)
+    {
+        auto const offset = i.path_[i.size_-1];
+        auto const p = node(offset);
+        for (auto b = selectBranch(p[1], key) + 1; b < 16; ++b)
         {
-            auto inner = std::static_pointer_cast<SHAMapInnerNode>(node);
-            int i = 0;
-            if (inner->has_common_prefix(id))
-                i = selectBranch(inner->depth(), id) + 1;
-            else if (id > inner->common())
-                i = 16;
-            for (; i < 16; ++i)
+            if (auto c = child(offset, b))
             {
-                if (!inner->isEmptyBranch(i))
-                {
-                    node = descendThrow(inner, i);
-                    auto leaf = firstBelow(node, stack);
-                    if (!leaf)
-                        throw 4;
-                    return const_iterator(this, leaf->peekItem().get(),
-                                          std::move(stack));
-                }
+                firstBelow(c, i);
+                return;
             }
         }
-        stack.pop_back();
+        --i.size_;
     }
-    return end();
 }
 
-static
-uint256
-prefix(unsigned depth, uint256 const& key)
+SHAMapMapped::const_iterator
+SHAMapMapped::begin() const
 {
-    uint256 r{};
-    auto x = r.begin();
-    auto y = key.begin();
-    for (auto i = 0; i < depth/2; ++i, ++x, ++y)
-        *x = *y;
-    if (depth & 1)
-        *x = *y & 0xF0;
-    return r;
+    const_iterator i{this};
+    if (root_ != 0)
+        firstBelow(root_, i);
+    return i;
 }
 
-bool
-SHAMap::insert(SHAMapHash const& hash, SHAMapItem const& item)
+SHAMapMapped::const_iterator
+SHAMapMapped::end() const
 {
-    auto key = item.key();
-    NodeStack stack;
-    walkTowardsKey(key, &stack);
-    auto node = stack.back().first;
-    auto nodeID = stack.back().second;
-    stack.pop_back();
-    if (node->isLeaf())
+    return const_iterator{this};
+}
+
+SHAMapMapped::const_iterator
+SHAMapMapped::findKey(uint256 const& id) const
+{
+    auto offset = root_;
+    const_iterator i{this};
+    while (offset != 0)
     {
-        // At leaf.  If this is not a duplicate,
-        //   need to create new inner node and insert current leaf and new leaf under it
-        auto leaf = std::static_pointer_cast<SHAMapTreeNode>(node);
-        if (item.key() != leaf->peekItem()->key())
+        if (i.size_ == 65)
+            throw std::runtime_error("SHAMapMapped: path too long");
+        i.path_[i.size_++] = offset;
+        auto const p = node(offset);
+        if (p[0] == 1)
         {
-            auto inner = std::make_shared<SHAMapInnerNode>(uint256{});
-            inner->setChildren(leaf, std::make_shared<SHAMapTreeNode>(hash, item));
-            assert(!stack.empty());
-            auto parent = std::static_pointer_cast<SHAMapInnerNode>(stack.back().first);
-            auto branch = selectBranch(stack.back().second.depth(), key);
-            parent->setChild(branch, inner);
-            return true;
+            if (std::equal(p + 40, p + 72, id.begin()))
+            {
+                i.item_ = Item{p};
+                return i;
+            }
+            break;
         }
-        return false;
-    }
-
-    auto inner = std::static_pointer_cast<SHAMapInnerNode>(node);
-    if (inner->has_common_prefix(key))
-    {
-        auto depth = inner->depth();
-        auto branch = selectBranch(depth, key);
-        assert(inner->isEmptyBranch(branch));
-        // place new leaf here
-        inner->setChild(branch, std::make_shared<SHAMapTreeNode>(hash, item));
-        return true;
-    }
-    else
-    {
-        // Create new inner node and place old inner node and new leaf below it
-        assert(!stack.empty());
-        auto parent = std::static_pointer_cast<SHAMapInnerNode>(stack.back().first);
-        auto parent_depth = parent->depth();
-        auto depth = inner->get_common_prefix(key);
-        auto new_inner = std::make_shared<SHAMapInnerNode>(uint256{});
-        new_inner->setChild(selectBranch(depth, inner->common()), inner);
-        new_inner->setChild(selectBranch(depth, key),
-                            std::make_shared<SHAMapTreeNode>(hash, item));
-        new_inner->set_common(depth, prefix(depth, key));
-        parent->setChild(selectBranch(parent_depth, key), new_inner);
-        stack.push_back({new_inner, {new_inner->depth(), new_inner->key()}});
-        return true;
+        uint256 common;
+        std::copy(p + 40, p + 72, common.begin());
+        if (commonNibbles(common, id) < p[1])
+            break;
+        offset = child(offset, selectBranch(p[1], id));
     }
+    return end();
 }
 
-SHAMap::const_iterator
-SHAMap::erase(const_iterator i)
+SHAMapMapped::const_iterator
+SHAMapMapped::upper_bound(uint256 const& id) const
 {
-    auto ci = i.stack_.size() - 1;
-    assert(ci >= 1);
-    auto child = std::static_pointer_cast<SHAMapTreeNode>(i.stack_[ci].first);
-    auto pi = ci - 1;
-    auto parent = std::static_pointer_cast<SHAMapInnerNode>(i.stack_[pi].first);
-    auto key = child->key();
-    auto branch = selectBranch(parent->depth(), key);
-    parent->setChild(branch, nullptr);
-    if (parent->numChildren() == 1 && parent->depth() > 0)
+    const_iterator i{this};
+    if (root_ == 0)
+        return i;
+    // Walk towards id, then back up until there is something greater
+    auto offset = root_;
+    while (true)
     {
-        assert(ci >= 2);
-        auto only_child = parent->firstChild();
-        auto child_branch = selectBranch(parent->depth(), only_child->key());
-        auto grand_parent = std::static_pointer_cast<SHAMapInnerNode>(i.stack_[pi-1].first);
-        auto& parent_key = parent->key();
-        auto next_branch = selectBranch(grand_parent->depth(), parent_key);
-        grand_parent->setChild(next_branch, only_child);
-        if (child_branch > branch)
+        if (i.size_ == 65)
+            throw std::runtime_error("SHAMapMapped: path too long");
+        i.path_[i.size_++] = offset;
+        auto const p = node(offset);
+        if (p[0] == 1)
+            break;
+        uint256 common;
+        std::copy(p + 40, p + 72, common.begin());
+        if (commonNibbles(common, id) < p[1])
+            break;
+        auto const c = child(offset, selectBranch(p[1], id));
+        if (c == 0)
+            break;
+        offset = c;
+    }
+    while (i.size_ > 0)
+    {
+        offset = i.path_[i.size_-1];
+        auto const p = node(offset);
+        uint256 key;
+        std::copy(p + 40, p + 72, key.begin());
+        if (p[0] == 1)
         {
-            i.stack_.erase(i.stack_.end()-2, i.stack_.end());
-            i.item_ = firstBelow(only_child, i.stack_)->peekItem().get();
-            return i;
+            if (key > id)
+            {
+                i.item_ = Item{p};
+                return i;
+            }
         }
         else
         {
-            i.stack_.erase(i.stack_.end()-2);
+            int b = 0;
+            if (commonNibbles(key, id) >= p[1])
+                b = selectBranch(p[1], id) + 1;
+            else if (id > key)
+                b = 16;
+            for (; b < 16; ++b)
+            {
+                if (auto c = child(offset, b))
+                {
+                    firstBelow(c, i);
+                    return i;
+                }
+            }
         }
+        --i.size_;
     }
-    i.item_ = i.map_->peekNextItem(key, i.stack_);
     return i;
 }
 
-void
-SHAMap::invariants() const
+SHAMapMapped::const_iterator&
+SHAMapMapped::const_iterator::operator++()
 {
-    auto node = root_.get();
-    assert(node != nullptr);
-    node->invariants(true);
+    map_->next(*this);
+    return *this;
+}
+
+SHAMapMapped::const_iterator
+SHAMapMapped::const_iterator::operator++(int)
+{
+    auto tmp = *this;
+    ++(*this);
+    return tmp;
 }
 
 // int
@@ -592,6 +3303,7 @@ SHAMap::invariants() const
 //     return branch;
 // }
 
+#include <cstdio>
 #include <iostream>
 #include <random>
 #include <vector>
@@ -642,6 +3354,32 @@ public:
     }
 };
 
+// A node store that has lost every node whose hash starts with a zero
+// byte, other than the root
+class lossy_store
+    : public SHAMapNodeStore
+{
+    std::shared_ptr<SHAMapNodeStore> store_;
+    SHAMapHash                       root_;
+public:
+    lossy_store(std::shared_ptr<SHAMapNodeStore> store, SHAMapHash const& root)
+        : store_{std::move(store)}
+        , root_{root}
+        {}
+
+    void store(SHAMapHash const& hash, Blob const& data) override
+    {
+        store_->store(hash, data);
+    }
+
+    bool fetch(SHAMapHash const& hash, Blob& data) override
+    {
+        if (hash[0] == 0 && hash != root_)
+            return false;
+        return store_->fetch(hash, data);
+    }
+};
+
 uint256
 make_key()
 {
@@ -672,17 +3410,579 @@ main()
     std::size_t sz = 0;
     for (auto const& k : keys)
     {
-        m.insert({0}, {k, {}});
+        m.insert({k, {}});
         m.invariants();
         ++sz;
         assert(std::distance(m.begin(), m.end()) == sz);
+        assert(m.size() == sz);
     }
 //     m.display(std::cout);
 //     std::cout << '\n';
+    auto const hash = m.getHash();
+    m.invariants();
+    {
+        // A map opened from a store behaves like the map that was saved,
+        // loading nodes as they are reached
+        char const* path = "shamap_test.nodes";
+        std::remove(path);
+        auto store = std::make_shared<SHAMapFileStore>(path);
+        m.save(*store);
+        SHAMap m5{hash, store};
+        assert(m5.getHash() == hash);
+        for (auto const& k : keys)
+            assert(m5.findKey(k) != m5.end());
+        m5.invariants();
+        assert(SHAMap(hash, store).size() == keys.size());
+        assert(m5.size() == keys.size());
+        m5.invariants();
+        auto k = make_key();
+        m5.insert({k, {1}});
+        assert(m5.getHash() != hash);
+        assert(m5.size() == keys.size() + 1);
+        m5.erase(m5.findKey(k));
+        assert(m5.getHash() == hash);
+        // erasing from a map loaded only along the erased keys' paths
+        SHAMap m6{hash, std::make_shared<SHAMapFileStore>(path)};
+        for (std::size_t i = 0; i < keys.size(); i += 2)
+            m6.erase(m6.findKey(keys[i]));
+        m6.invariants();
+        std::size_t diffs = 0;
+        m6.compare(m, [&](SHAMapItem const* x, SHAMapItem const* y)
+                      {
+                          assert(x == nullptr && y != nullptr);
+                          ++diffs;
+                      });
+        assert(diffs == (keys.size() + 1) / 2);
+        assert(static_cast<std::size_t>(std::distance(m6.begin(), m6.end())) ==
+               keys.size() / 2);
+        {
+            // Maps sharing a cache find each other's nodes there, and
+            // changing one of them leaves the cached nodes alone
+            auto cache = std::make_shared<SHAMapNodeCache>(1 << 20);
+            {
+                SHAMap a{hash, store, cache};
+                assert(static_cast<std::size_t>(std::distance(a.begin(), a.end())) ==
+                       keys.size());
+            }
+            auto const hits = cache->hits();
+            SHAMap b{hash, store, cache};
+            SHAMap c{hash, store, cache};
+            for (auto const& k : keys)
+                assert(b.findKey(k) != b.end());
+            assert(cache->hits() > hits);
+            assert(cache->bytes() <= cache->budget());
+            b.insert({k, {1}});
+            b.erase(b.findKey(keys[0]));
+            b.invariants();
+            assert(c.findKey(k) == c.end());
+            assert(c.findKey(keys[0]) != c.end());
+            assert(c.getHash() == hash);
+            // unload drops the nodes b loaded and left unchanged, which it
+            // then finds in the cache again, and keeps its own changes
+            auto const changed = b.getHash();
+            b.unload();
+            b.invariants();
+            auto lookups = cache->hits() + cache->misses();
+            for (std::size_t i = 1; i < keys.size(); ++i)
+                assert(b.findKey(keys[i]) != b.end());
+            assert(cache->hits() + cache->misses() > lookups);
+            lookups = cache->hits() + cache->misses();
+            for (std::size_t i = 1; i < keys.size(); ++i)
+                assert(b.findKey(keys[i]) != b.end());
+            assert(cache->hits() + cache->misses() == lookups);
+            b.unload();
+            assert(b.findKey(k) != b.end());
+            assert(b.findKey(keys[0]) == b.end());
+            assert(b.size() == keys.size());
+            assert(b.getHash() == changed);
+            // size has loaded every node again, and those shared with a
+            // snapshot stay
+            auto sb = b.snapshot();
+            b.unload();
+            lookups = cache->hits() + cache->misses();
+            assert(std::distance(sb.begin(), sb.end()) ==
+                   std::distance(b.begin(), b.end()));
+            assert(cache->hits() + cache->misses() == lookups);
+        }
+        {
+            // Maps sharing a cache may be read from different threads, and
+            // the cache keeps no more than its budget once they are gone
+            auto cache = std::make_shared<SHAMapNodeCache>(1 << 19);
+            {
+                SHAMap a{hash, store, cache};
+                SHAMap b{hash, store, cache};
+                auto lookup = [&keys](SHAMap const& x)
+                {
+                    for (auto const& k : keys)
+                        assert(x.findKey(k) != x.end());
+                };
+                std::thread t{lookup, std::cref(a)};
+                lookup(b);
+                t.join();
+            }
+            assert(cache->bytes() <= cache->budget());
+            {
+                // An inner node is charged for all of its slots, used or not
+                SHAMapNodeCache small{1 << 20, 1};
+                auto& pool = *small.pool();
+                uint256 k1{}, k2{}, k3{};
+                k1[0] = 0x10;
+                k2[0] = 0x20;
+                k3[0] = 0x30;
+                auto inner = pool.make<SHAMapInnerNode>(0);
+                inner->setChildren(SHAMapTreeNode::make(pool, 0, SHAMapItem{k1, {}}),
+                                   SHAMapTreeNode::make(pool, 0, SHAMapItem{k2, {}}));
+                inner->setChild(3, SHAMapTreeNode::make(pool, 0, SHAMapItem{k3, {}}));
+                inner->updateHash();
+                assert(inner->numChildren() == 3 && inner->capacity() == 4);
+                small.insert(inner);
+                assert(small.bytes() ==
+                       SHAMapNodePool::blockSize(sizeof(SHAMapInnerNode)) +
+                       SHAMapNodePool::blockSize(inner->slotBlockBytes()));
+            }
+            char const* empty = "shamap_test.empty";
+            std::remove(empty);
+            std::size_t found = 0;
+            try
+            {
+                SHAMap d{hash, std::make_shared<SHAMapFileStore>(empty), cache};
+                for (auto const& k : keys)
+                {
+                    try
+                    {
+                        found += d.findKey(k) != d.end();
+                    }
+                    catch (SHAMapMissingNode const&)
+                    {
+                    }
+                }
+            }
+            catch (SHAMapMissingNode const&)
+            {
+            }
+            assert(found < keys.size());
+            std::remove(empty);
+        }
+        {
+            // Sync a map from its root node, fetching what is missing from
+            // the store as a peer would, one batch at a time
+            Blob data;
+            auto fetched = store->fetch(hash, data);
+            assert(fetched);
+            SHAMap sync{hash, data};
+            auto missing = sync.getMissingNodes(256, [](SHAMapHash const&)
+                                                     {
+                                                         return false;
+                                                     });
+            assert(missing.empty());
+            unsigned rounds = 0;
+            for (; !(missing = sync.getMissingNodes(256)).empty(); ++rounds)
+            {
+                for (auto const& node : missing)
+                {
+                    fetched = store->fetch(node.second, data);
+                    assert(fetched);
+                    if (&node == &missing.front())
+                    {
+                        // the wrong node, and then the right one twice
+                        Blob other;
+                        fetched = store->fetch(missing.back().second, other);
+                        assert(fetched);
+                        if (missing.size() > 1)
+                        {
+                            auto const r = sync.addKnownNode(node.first, other);
+                            assert(r == SHAMap::AddNode::invalid);
+                        }
+                        auto r = sync.addKnownNode(node.first, data);
+                        assert(r == SHAMap::AddNode::useful);
+                        r = sync.addKnownNode(node.first, data);
+                        assert(r == SHAMap::AddNode::duplicate);
+                    }
+                    else
+                    {
+                        auto const r = sync.addKnownNode(node.first, data);
+                        assert(r == SHAMap::AddNode::useful);
+                    }
+                }
+            }
+            assert(rounds > 1);
+            sync.invariants();
+            assert(sync.getHash() == hash);
+            assert(std::distance(sync.begin(), sync.end()) ==
+                   std::distance(m.begin(), m.end()));
+            // A synced map's subtree counts are not yet known; publishing
+            // settles them, so concurrent readers only read the nodes
+            SHAMapPublisher pub{sync, 2};
+            auto r1 = pub.read();
+            auto r2 = pub.read();
+            std::size_t n1 = 0;
+            std::thread t{[&]{n1 = r1->size();}};
+            auto const n2 = r2->size();
+            t.join();
+            assert(n1 == keys.size() && n2 == keys.size());
+        }
+        {
+            // A parallel insert that runs into a missing node throws as a
+            // serial one does, leaving the map consistent
+            auto lossy = std::make_shared<lossy_store>(store, hash);
+            std::vector<SHAMapItem> items;
+            for (unsigned i = 0; i < 2000; ++i)
+                items.push_back({make_key(), {}});
+            for (unsigned threads : {1u, 4u})
+            {
+                SHAMap l{hash, lossy};
+                try
+                {
+                    l.insert_parallel(items.begin(), items.end(), threads);
+                    assert(false);
+                }
+                catch (SHAMapMissingNode const& e)
+                {
+                    assert(e.hash()[0] == 0);
+                }
+                l.invariants();
+                l.getHash();
+                l.invariants();
+            }
+        }
+        try
+        {
+            SHAMap{SHAMapHash{{1}}, store};
+            assert(false);
+        }
+        catch (SHAMapMissingNode const& e)
+        {
+            assert(e.hash() == SHAMapHash{{1}});
+        }
+        std::remove(path);
+
+        // The mapped form reads the same as the map that wrote it
+        m.saveMapped(path);
+        {
+            SHAMapMapped mm{path};
+            assert(mm.getHash() == hash);
+            assert(std::equal(m.begin(), m.end(), mm.begin(),
+                              [](SHAMapItem const& x, SHAMapMapped::Item const& y)
+                              {
+                                  return x.key() == y.key() && x.data().size() == y.size() &&
+                                         std::equal(x.data().begin(), x.data().end(),
+                                                    y.data());
+                              }));
+            assert(std::distance(mm.begin(), mm.end()) == std::distance(m.begin(), m.end()));
+            for (auto const& k : keys)
+                assert(mm.findKey(k)->key() == k);
+            for (unsigned i = 0; i < 100; ++i)
+            {
+                auto k = make_key();
+                assert(mm.findKey(k) == mm.end());
+                auto j = m.upper_bound(k);
+                auto jj = mm.upper_bound(k);
+                assert((j == m.end()) == (jj == mm.end()));
+                assert(j == m.end() || j->key() == jj->key());
+            }
+        }
+        std::remove(path);
+        SHAMap d;
+        for (unsigned i = 0; i < 50; ++i)
+            d.insert({keys[i], Blob(i, static_cast<unsigned char>(i))});
+        d.saveMapped(path);
+        {
+            SHAMapMapped mm{path};
+            assert(mm.getHash() == d.getHash());
+            for (auto const& x : d)
+            {
+                auto y = mm.findKey(x.key());
+                assert(y->size() == x.data().size() &&
+                       std::equal(x.data().begin(), x.data().end(), y->data()));
+            }
+        }
+        std::remove(path);
+        SHAMap{}.saveMapped(path);
+        {
+            SHAMapMapped mm{path};
+            assert(mm.getHash() == SHAMapHash{});
+            assert(mm.begin() == mm.end());
+        }
+        std::remove(path);
+    }
+    {
+        // The hash depends only on the contents, not the insertion order
+        SHAMap m2{std::make_shared<SHAMapNodePool>(SHAMapNodePool::arena)};
+        for (auto k = keys.rbegin(); k != keys.rend(); ++k)
+        {
+            m2.insert({*k, {}});
+            if (std::distance(k, keys.rend()) % 1000 == 0)
+                m2.getHash();
+        }
+        assert(m2.getHash(4) == hash);
+        m2.invariants();
+        auto const added = m2.insert({keys.front(), {1}});
+        assert(!added);
+        auto s2 = m2.snapshot();
+        auto k = make_key();
+        // emplace moves a large payload into the leaf, and leaves the
+        // caller's data alone if the key is present
+        Blob data(SHAMapTreeNode::maxInline + 1, 7);
+        auto const bytes = data.data();
+        auto emplaced = m2.emplace(k, std::move(data));
+        assert(emplaced);
+        assert(m2.findKey(k)->data().data() == bytes);
+        Blob small{4};
+        emplaced = m2.emplace(k, std::move(small));
+        assert(!emplaced);
+        assert(small == Blob{4});
+        assert(m2.findKey(k)->data() == Blob(SHAMapTreeNode::maxInline + 1, 7));
+        m2.erase(m2.findKey(k));
+        // a small payload is kept in the leaf's own block
+        small = {1, 2, 3};
+        emplaced = m2.emplace(k, std::move(small));
+        assert(emplaced);
+        assert(m2.findKey(k)->data() == (Blob{1, 2, 3}));
+        assert(m2.findKey(k)->data().data() != small.data());
+        assert(m2.getHash() != hash);
+        assert(s2.findKey(k) == s2.end());
+        m2.erase(m2.findKey(k));
+        assert(m2.getHash() == hash);
+        m2.invariants();
+        assert(s2.getHash() == hash);
+    }
+    {
+        // Building from sorted items gives the same tree as inserting them
+        std::vector<SHAMapItem> items;
+        for (auto const& i : m)
+            items.push_back(i);
+        SHAMap m3;
+        m3.assign(items.begin(), items.end(), true);
+        m3.invariants();
+        assert(m3.getHash() == hash);
+        m3.assign(items.begin() + 1, items.end());
+        assert(m3.getHash() != hash);
+        auto const added = m3.insert(items.front());
+        assert(added);
+        assert(m3.getHash() == hash);
+        assert(std::equal(m3.begin(), m3.end(), m.begin(),
+                          [](SHAMapItem const& x, SHAMapItem const& y)
+                          {
+                              return x.key() == y.key();
+                          }));
+        // Inserting in parallel, into an empty map or into a snapshot of a
+        // partly built one, gives the same tree as inserting one at a time
+        {
+            SHAMap m4;
+            auto added = m4.insert_parallel(items.rbegin(), items.rend(), 8);
+            assert(added == items.size());
+            m4.invariants();
+            assert(m4.size() == items.size());
+            assert(m4.getHash() == hash);
+            SHAMap m7;
+            m7.assign(items.begin(), items.begin() + items.size() / 2, true);
+            auto const half = m7.getHash();
+            auto s7 = m7.snapshot();
+            added = m7.insert_parallel(items.begin(), items.end(), 3);
+            assert(added == items.size() - items.size() / 2);
+            m7.invariants();
+            assert(m7.size() == items.size());
+            assert(m7.getHash() == hash);
+            assert(s7.getHash() == half);
+        }
+        // Hinted inserts of keys arriving in order, forwards or backwards,
+        // give the same tree, and a hinted insert of a present key finds it
+        {
+            SHAMap m8;
+            auto hint = m8.end();
+            for (auto const& item : items)
+            {
+                hint = m8.insert(hint, item);
+                assert(hint->key() == item.key());
+            }
+            m8.invariants();
+            assert(m8.getHash() == hash);
+            SHAMap m9;
+            hint = m9.end();
+            for (auto i = items.rbegin(); i != items.rend(); ++i)
+                hint = m9.insert(hint, SHAMapItem{*i});
+            m9.invariants();
+            assert(m9.getHash() == hash);
+            auto const& mid = items[items.size() / 2];
+            hint = m9.insert(m9.begin(), mid);
+            assert(&*hint == &*m9.findKey(mid.key()));
+            assert(m9.size() == items.size());
+            assert(std::next(hint) == m9.upper_bound(mid.key()));
+            // A hint whose path other inserts have since changed is still
+            // safe to use
+            SHAMap m10;
+            auto key = [](unsigned char a, unsigned char b, unsigned char c)
+            {
+                uint256 k{};
+                k[0] = a;
+                k[1] = b;
+                k[2] = c;
+                return k;
+            };
+            m10.insert({key(0x12, 0x34, 0x00), {}});
+            m10.insert({key(0x12, 0x34, 0x10), {}});
+            m10.insert({key(0x56, 0x78, 0x00), {}});
+            auto cur = m10.findKey(key(0x12, 0x34, 0x00));
+            m10.insert({key(0x12, 0x99, 0x00), {}});
+            m10.getHash();
+            cur = m10.insert(cur, SHAMapItem{key(0x12, 0x34, 0x70), {}});
+            assert(cur->key() == key(0x12, 0x34, 0x70));
+            m10.invariants();
+            assert(m10.size() == 5);
+            m10.erase(m10.findKey(key(0x12, 0x34, 0x10)));
+            cur = m10.insert(cur, SHAMapItem{key(0x12, 0x34, 0x71), {}});
+            m10.invariants();
+            assert(m10.size() == 5);
+            assert(std::distance(m10.begin(), m10.end()) == 5);
+        }
+        // compare reports exactly what a merge of the two maps finds
+        std::vector<std::pair<SHAMapItem const*, SHAMapItem const*>> diffs;
+        m.compare(m3, [&](SHAMapItem const* x, SHAMapItem const* y)
+                      {
+                          diffs.emplace_back(x, y);
+                      });
+        assert(diffs.empty());
+        for (std::size_t i = 0; i < items.size(); i += 7)
+            m3.erase(m3.findKey(items[i].key()));
+        for (std::size_t i = 3; i < items.size(); i += 11)
+        {
+            if (i % 7 == 0)
+                continue;
+            m3.erase(m3.findKey(items[i].key()));
+            m3.insert({items[i].key(), {1}});
+        }
+        for (unsigned i = 0; i < 100; ++i)
+            m3.insert({make_key(), {2}});
+        m.compare(m3, [&](SHAMapItem const* x, SHAMapItem const* y)
+                      {
+                          diffs.emplace_back(x, y);
+                      });
+        std::vector<std::pair<SHAMapItem const*, SHAMapItem const*>> expected;
+        auto x = m.begin();
+        auto y = m3.begin();
+        while (x != m.end() || y != m3.end())
+        {
+            if (y == m3.end() || (x != m.end() && x->key() < y->key()))
+                expected.emplace_back(&*x++, nullptr);
+            else if (x == m.end() || y->key() < x->key())
+                expected.emplace_back(nullptr, &*y++);
+            else
+            {
+                if (x->data() != y->data())
+                    expected.emplace_back(&*x, &*y);
+                ++x;
+                ++y;
+            }
+        }
+        assert(diffs == expected);
+    }
+    {
+        // Batched lookup agrees with findKey, for present and absent keys
+        std::vector<uint256> probe(keys.begin(), keys.begin() + keys.size() / 2);
+        for (unsigned i = 0; i < 100; ++i)
+            probe.push_back(make_key());
+        std::vector<SHAMapItem const*> found(probe.size());
+        m.findKeys(probe.data(), probe.size(), found.data());
+        for (std::size_t i = 0; i < probe.size(); ++i)
+        {
+            auto j = m.findKey(probe[i]);
+            assert(found[i] == (j == m.end() ? nullptr : &*j));
+        }
+    }
+    {
+        // Blocks freed through a ThreadCache go back to the pool with it
+        SHAMapNodePool pool;
+        std::vector<void*> blocks;
+        {
+            SHAMapNodePool::ThreadCache cache{pool};
+            for (std::size_t i = 0; i < 3 * SHAMapNodePool::cacheBatch; ++i)
+                blocks.push_back(pool.allocate(48));
+            for (auto p : blocks)
+                pool.deallocate(p, 48);
+        }
+        for (std::size_t i = 0; i < blocks.size(); ++i)
+        {
+            auto p = pool.allocate(48);
+            assert(std::find(blocks.begin(), blocks.end(), p) != blocks.end());
+        }
+    }
+    {
+        // Nodes survive a trip through their wire form, and a node hashes
+        // to the hash of its wire form
+        static_assert(std::is_nothrow_move_constructible<SHAMapItem>::value,
+                      "items must move, not copy, when a vector of them grows");
+        static_assert(!std::is_convertible<SHAMapNodePtr<SHAMapAbstractNode>,
+                                           SHAMapNodePtr<SHAMapTreeNode>>::value,
+                      "node handles must not downcast implicitly");
+        SHAMapNodePool pool;
+        auto leaf1 = SHAMapTreeNode::make(pool, 0, SHAMapItem{keys[0], {1, 2, 3}});
+        auto leaf2 = SHAMapTreeNode::make(pool, 0, SHAMapItem{keys[1], {}});
+        auto inner = pool.make<SHAMapInnerNode>(0);
+        inner->setChildren(leaf1, leaf2);
+        inner->updateHash();
+        for (SHAMapAbstractNode const* node : {static_cast<SHAMapAbstractNode const*>(leaf1.get()),
+                                               static_cast<SHAMapAbstractNode const*>(inner.get())})
+        {
+            Blob wire;
+            node->serialize(wire);
+            auto copy = SHAMapAbstractNode::deserialize(pool, 0, wire.data(), wire.size());
+            assert(copy != nullptr);
+            assert(copy->isLeaf() == node->isLeaf());
+            assert(copy->getHash() == node->getHash());
+            assert(copy->key() == node->key() && copy->depth() == node->depth());
+            Blob wire2;
+            copy->serialize(wire2);
+            assert(wire2 == wire);
+            if (!node->isLeaf())
+            {
+                assert(static_pointer_cast<SHAMapInnerNode>(copy)->numChildren() == 2);
+                // a truncated or mislabeled node is rejected
+                assert(SHAMapAbstractNode::deserialize(pool, 0, wire.data(),
+                                                       wire.size() - 1) == nullptr);
+                wire[0] = 'X';
+                assert(SHAMapAbstractNode::deserialize(pool, 0, wire.data(),
+                                                       wire.size()) == nullptr);
+            }
+        }
+    }
+    {
+        // Proofs of inclusion and exclusion check out against the root hash,
+        // and fail against any other
+        for (std::size_t i = 0; i < 100; ++i)
+        {
+            auto path = m.getProofPath(keys[i]);
+            assert(verifyProofPath(hash, keys[i], path) == SHAMapProof::included);
+            assert(verifyProofPath(hash, keys[i+1], path) == SHAMapProof::invalid);
+            auto k = make_key();
+            auto other = m.getProofPath(k);
+            assert(verifyProofPath(hash, k, other) == SHAMapProof::excluded);
+            assert(verifyProofPath(SHAMapHash{{1}}, k, other) == SHAMapProof::invalid);
+            path.pop_back();
+            assert(verifyProofPath(hash, keys[i], path) == SHAMapProof::invalid);
+            other.back().back() ^= 1;
+            assert(verifyProofPath(hash, k, other) == SHAMapProof::invalid);
+        }
+        assert(verifyProofPath(SHAMapHash{}, keys[0], SHAMap{}.getProofPath(keys[0])) ==
+               SHAMapProof::excluded);
+    }
     for (auto i = m.begin(); i != m.end(); ++i)
     {
         auto j = m.upper_bound(i->key());
         assert(std::next(i) == j);
+        assert(m.lower_bound(i->key()) == i);
+        assert(std::prev(j) == i);
+        assert(m.predecessor(i->key()) == (i == m.begin() ? m.end() : std::prev(i)));
+    }
+    {
+        // Walking backwards visits the items in reverse order
+        std::vector<uint256> forward;
+        for (auto const& i : m)
+            forward.push_back(i.key());
+        std::vector<uint256> backward;
+        for (auto i = m.rbegin(); i != m.rend(); ++i)
+            backward.push_back(i->key());
+        std::reverse(backward.begin(), backward.end());
+        assert(backward == forward);
     }
     for (unsigned i = 0; i < keys.size(); ++i)
     {
@@ -697,7 +3997,90 @@ main()
             assert(h->key() < k);
         for (auto h = j; h != m.end(); ++h)
             assert(h->key() > k);
+        assert(m.lower_bound(k) == j);
+        assert(m.predecessor(k) == (j == m.begin() ? m.end() : std::prev(j)));
+    }
+    {
+        // rank and nth agree with the position of each item in key order
+        std::size_t r = 0;
+        for (auto i = m.begin(); i != m.end(); ++i, ++r)
+        {
+            assert(m.rank(i->key()) == r);
+            assert(m.nth(r) == i);
+        }
+        assert(m.nth(r) == m.end());
+        for (int i = 0; i < 1000; ++i)
+        {
+            auto k = make_key();
+            assert(m.rank(k) ==
+                   static_cast<std::size_t>(std::distance(m.begin(), m.lower_bound(k))));
+        }
+    }
+    {
+        // Readers always see a whole published version while the writer
+        // goes on inserting, and versions no reader holds are destroyed
+        std::size_t const n = std::min<std::size_t>(keys.size(), 2000);
+        SHAMap w;
+        SHAMapPublisher pub{w, 8};
+        std::atomic<bool> done{false};
+        auto reader = [&]
+        {
+            while (!done)
+            {
+                auto r = pub.read();
+                auto const size = r->size();
+                assert(size <= n);
+                assert(static_cast<std::size_t>(std::distance(r->begin(), r->end())) == size);
+                if (size > 0)
+                    assert(r->findKey(keys[size-1]) != r->end());
+                if (size < n)
+                    assert(r->findKey(keys[size]) == r->end());
+            }
+        };
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t)
+            readers.emplace_back(reader);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            w.insert({keys[i], {}});
+            if (i % 100 == 99)
+                pub.publish(w);
+        }
+        done = true;
+        for (auto& t : readers)
+            t.join();
+        pub.publish(w);
+        assert(pub.retired() == 0);
+        assert(pub.read()->getHash() == w.getHash());
+        try
+        {
+            SHAMapPublisher none{w, 0};
+            assert(false);
+        }
+        catch (std::invalid_argument const&)
+        {
+        }
+        // More readers than slots wait for a slot rather than fail
+        SHAMapPublisher one{w, 1};
+        std::atomic<int> reads{0};
+        std::vector<std::thread> many;
+        {
+            auto held = one.read();
+            for (int t = 0; t < 4; ++t)
+                many.emplace_back([&]
+                                  {
+                                      for (int i = 0; i < 100; ++i)
+                                          reads += one.read()->size() == n;
+                                  });
+            std::this_thread::yield();
+            assert(reads == 0);
+        }
+        for (auto& t : many)
+            t.join();
+        assert(reads == 400);
     }
+    auto snap = m.snapshot();
+    assert(!snap.isMutable());
     for (auto const& k : keys)
     {
         auto i = m.findKey(k);
@@ -709,8 +4092,66 @@ main()
         m.invariants();
         --sz;
         assert(std::distance(m.begin(), m.end()) == sz);
+        assert(m.size() == sz);
         assert(i == j);
 //         m.display(std::cout);
 //         std::cout << '\n';
     }
+    assert(m.getHash() == SHAMapHash{});
+    // The snapshot is unaffected by erasing everything from m
+    snap.invariants();
+    assert(snap.getHash() == hash);
+    assert(static_cast<std::size_t>(std::distance(snap.begin(), snap.end())) ==
+           keys.size());
+    for (auto const& k : keys)
+        assert(snap.findKey(k) != snap.end());
+    {
+        // Erasing a sorted batch of keys, some absent, gives the same tree
+        // as erasing them one at a time
+        std::vector<uint256> sorted;
+        for (auto const& i : snap)
+            sorted.push_back(i.key());
+        std::vector<uint256> batch;
+        for (std::size_t i = 0; i < sorted.size(); i += 3)
+        {
+            batch.push_back(sorted[i]);
+            auto absent = sorted[i];
+            absent[31] ^= 1;
+            if (snap.findKey(absent) == snap.end() &&
+                (i + 1 == sorted.size() || absent < sorted[i+1]))
+                batch.push_back(absent);
+        }
+        std::sort(batch.begin(), batch.end());
+        SHAMap e1;
+        e1.assign(snap.begin(), snap.end(), true);
+        auto s1 = e1.snapshot();
+        std::vector<uint256> none;
+        for (auto const& k : batch)
+        {
+            if (snap.findKey(k) == snap.end())
+                none.push_back(k);
+        }
+        assert(!none.empty());
+        auto erased = e1.erase_batch(none.data(), none.size());
+        assert(erased == 0);
+        assert(e1.getHash() == hash);
+        SHAMap e2;
+        e2.assign(snap.begin(), snap.end());
+        erased = 0;
+        for (auto const& k : batch)
+            erased += e2.erase(k);
+        auto const again = e2.erase(sorted[0]);
+        assert(!again);
+        auto const batched = e1.erase_batch(batch.data(), batch.size());
+        assert(batched == erased);
+        assert(erased == (sorted.size() + 2) / 3);
+        e1.invariants();
+        assert(e1.size() == sorted.size() - erased);
+        assert(e1.getHash() == e2.getHash());
+        assert(s1.getHash() == hash);
+        auto const rest = e1.erase_batch(sorted.data(), sorted.size());
+        assert(rest == sorted.size() - erased);
+        assert(e1.getHash() == SHAMapHash{});
+        assert(e1.size() == 0);
+    }
 }
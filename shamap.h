@@ -2,11 +2,25 @@
 #define SHAMAP_H
 
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <ostream>
-#include <stack>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using uint256 = std::array<unsigned char, 256/8>;
@@ -25,6 +39,7 @@ public:
 
 //     int selectBranch (uint256 const& key) const;
     unsigned depth() const {return depth_;}
+    uint256 const& getNodeID() const {return NodeID_;}
 
     SHAMapNodeID(unsigned depth, uint256 const& hash)
         : NodeID_{hash}
@@ -32,40 +47,283 @@ public:
         {}
 };
 
+// A view of the payload of an item, valid for as long as the item is
+class SHAMapData
+{
+    unsigned char const* data_ = nullptr;
+    std::size_t          size_ = 0;
+public:
+    SHAMapData() = default;
+    SHAMapData(unsigned char const* data, std::size_t size)
+        : data_{data}
+        , size_{size}
+        {}
+
+    SHAMapData(Blob const& data)
+        : data_{data.data()}
+        , size_{data.size()}
+        {}
+
+    unsigned char const* data() const {return data_;}
+    std::size_t size() const {return size_;}
+    bool empty() const {return size_ == 0;}
+    unsigned char const* begin() const {return data_;}
+    unsigned char const* end() const {return data_ + size_;}
+    unsigned char operator[](std::size_t i) const {return data_[i];}
+
+    friend bool operator==(SHAMapData const& x, SHAMapData const& y)
+        {return x.size_ == y.size_ && std::equal(x.begin(), x.end(), y.begin());}
+    friend bool operator!=(SHAMapData const& x, SHAMapData const& y)
+        {return !(x == y);}
+};
+
+// An item owns its payload, in data_, except for the item of a leaf that
+// keeps its payload in its own block (see SHAMapTreeNode).  Either way
+// data() is a view of it.  Copying an item copies the payload into the
+// copy's own data_.
 class SHAMapItem
 {
-    uint256 tag_;  // prefix same as SHAMapNodeID.NodeID_[0, depth_)
-    Blob    data_;
+    uint256              tag_;  // prefix same as SHAMapNodeID.NodeID_[0, depth_)
+    Blob                 data_;
+    unsigned char const* p_;
+    std::size_t          size_;
+
+    struct Borrow {};
+    // Refer to the payload data[0, size) held by the owner of this item
+    SHAMapItem(uint256 const& tag, unsigned char const* data, std::size_t size, Borrow)
+        : tag_{tag}
+        , p_{data}
+        , size_{size}
+        {}
+
+    friend class SHAMapTreeNode;
 public:
     SHAMapItem(uint256 const& tag, Blob const& data)
         : tag_{tag}
         , data_{data}
+        , p_{data_.data()}
+        , size_{data_.size()}
+        {}
+
+    SHAMapItem(uint256 const& tag, Blob&& data)
+        : tag_{tag}
+        , data_{std::move(data)}
+        , p_{data_.data()}
+        , size_{data_.size()}
+        {}
+
+    SHAMapItem(uint256 const& tag, unsigned char const* data, std::size_t size)
+        : tag_{tag}
+        , data_(data, data + size)
+        , p_{data_.data()}
+        , size_{data_.size()}
+        {}
+
+    SHAMapItem(SHAMapItem const& x)
+        : SHAMapItem{x.tag_, x.p_, x.size_}
         {}
 
+    // noexcept, so that containers of items move them as they grow.  An
+    // item owning its payload moves it; one borrowing a leaf's payload
+    // copies it, and terminates if that copy cannot be allocated.
+    SHAMapItem(SHAMapItem&& x) noexcept;
+    SHAMapItem& operator=(SHAMapItem x);
+
     uint256 const& key() const {return tag_;}
+    SHAMapData data() const {return {p_, size_};}
 
     friend std::ostream& operator<<(std::ostream& os, SHAMapItem const& x);
 };
 
+inline
+SHAMapItem::SHAMapItem(SHAMapItem&& x) noexcept
+    : tag_{x.tag_}
+    , data_{x.p_ == x.data_.data() ? std::move(x.data_) : Blob(x.p_, x.p_ + x.size_)}
+    , p_{data_.data()}
+    , size_{data_.size()}
+{
+    x.data_.clear();
+    x.p_ = x.data_.data();
+    x.size_ = 0;
+}
+
+inline
+SHAMapItem&
+SHAMapItem::operator=(SHAMapItem x)
+{
+    // x owns its payload
+    tag_ = x.tag_;
+    data_ = std::move(x.data_);
+    p_ = data_.data();
+    size_ = data_.size();
+    return *this;
+}
+
+// An owning handle to a node, whose reference count is kept in the node
+// itself.  A handle is one pointer wide, and a handle can be made from a
+// plain node pointer at any time.  Traversals pass plain pointers and only
+// code that stores a node takes a handle.
+template <class Node>
+class SHAMapNodePtr
+{
+    Node* p_ = nullptr;
+
+    template <class U> friend class SHAMapNodePtr;
+public:
+    SHAMapNodePtr() = default;
+    SHAMapNodePtr(std::nullptr_t) {}
+
+    explicit SHAMapNodePtr(Node* p)
+        : p_{p}
+    {
+        if (p_ != nullptr)
+            p_->addRef();
+    }
+
+    SHAMapNodePtr(SHAMapNodePtr const& x)
+        : SHAMapNodePtr{x.p_}
+        {}
+
+    SHAMapNodePtr(SHAMapNodePtr&& x) noexcept
+        : p_{x.p_}
+    {
+        x.p_ = nullptr;
+    }
+
+    // Only from handles to types that convert implicitly, as pointers do;
+    // downcasts go through static_pointer_cast
+    template <class U, class = typename std::enable_if<
+                           std::is_convertible<U*, Node*>::value>::type>
+    SHAMapNodePtr(SHAMapNodePtr<U> const& x)
+        : SHAMapNodePtr{x.p_}
+        {}
+
+    template <class U, class = typename std::enable_if<
+                           std::is_convertible<U*, Node*>::value>::type>
+    SHAMapNodePtr(SHAMapNodePtr<U>&& x) noexcept
+        : p_{x.p_}
+    {
+        x.p_ = nullptr;
+    }
+
+    ~SHAMapNodePtr()
+    {
+        if (p_ != nullptr)
+            p_->release();
+    }
+
+    SHAMapNodePtr& operator=(SHAMapNodePtr x) noexcept
+    {
+        std::swap(p_, x.p_);
+        return *this;
+    }
+
+    Node* get() const {return p_;}
+    Node& operator*() const {return *p_;}
+    Node* operator->() const {return p_;}
+    explicit operator bool() const {return p_ != nullptr;}
+
+    friend bool operator==(SHAMapNodePtr const& x, std::nullptr_t) {return x.p_ == nullptr;}
+    friend bool operator!=(SHAMapNodePtr const& x, std::nullptr_t) {return x.p_ != nullptr;}
+};
+
+// A handle to the node x refers to, as a Node, which it must be
+template <class Node, class U>
+inline
+SHAMapNodePtr<Node>
+static_pointer_cast(SHAMapNodePtr<U> const& x)
+{
+    return SHAMapNodePtr<Node>{static_cast<Node*>(x.get())};
+}
+
+class SHAMapNodePool;
+
+// Node hashes are computed lazily.  A mutation only marks the nodes on the
+// path from the changed leaf up to the root as dirty.  SHAMap::getHash()
+// then rehashes just the dirty nodes, bottom up.  A node that is dirty
+// always has a dirty parent, so marking can stop at the first dirty ancestor.
+//
+// cowid_ identifies the SHAMap that may modify the node in place.  Any other
+// map sharing the node (see SHAMap::snapshot) must clone it before writing.
+//
+// Nodes are created by SHAMapNodePool::make, and return themselves to that
+// pool when the last SHAMapNodePtr to them goes away.  Inner nodes also take
+// their child slots from that pool.
+//
+// The wire form of a node is exactly the data its hash is taken over, so a
+// node received from elsewhere is checked by hashing it.  An inner node is
+// "MIN\0", its depth, the first (depth+1)/2 bytes of common(), its branch
+// bitmap as two big-endian bytes and the hashes of its non-empty branches in
+// branch order.  A leaf is "MLN\0", its key and its data.
+//
+// The concrete type of a node is recorded in kind_.  The functions used on
+// the lookup, iteration and hashing paths dispatch on it directly; only the
+// display and debugging functions are virtual.
 class SHAMapAbstractNode
 {
-    SHAMapHash hash_;
+public:
+    enum class Kind : std::uint8_t {inner, leaf};
+
+private:
+    mutable std::atomic<std::uint32_t> refcount_{0};
+protected:
+    std::uint32_t                      cowid_;
+    SHAMapNodePool*                    pool_ = nullptr;
+    SHAMapHash                         hash_ = {};
+    bool                               dirty_ = true;
+    bool                               stored_ = false;  // as loaded from a store
+    Kind const                         kind_;
+
 public:
     virtual ~SHAMapAbstractNode() = 0;
     SHAMapAbstractNode(SHAMapAbstractNode const&) = delete;
     SHAMapAbstractNode& operator=(SHAMapAbstractNode const &) = delete;
 
-    explicit SHAMapAbstractNode(SHAMapHash const& hash)
-        : hash_{hash}
+    SHAMapAbstractNode(Kind kind, SHAMapNodePool& pool, std::uint32_t cowid)
+        : cowid_{cowid}
+        , pool_{&pool}
+        , kind_{kind}
         {}
 
-    bool isLeaf () const;
+    bool isLeaf () const {return kind_ == Kind::leaf;}
+    std::uint32_t cowid() const {return cowid_;}
+
+    void addRef() const {refcount_.fetch_add(1, std::memory_order_relaxed);}
+    void release() const;
+
+    SHAMapHash const& getHash() const {return hash_;}
+    bool isDirty() const {return dirty_;}
+    void setDirty() {dirty_ = true; stored_ = false;}
+    // True if this node was loaded from a store and has not changed since,
+    // so that it can be loaded again
+    bool isStored() const {return stored_;}
+    void setStored() {stored_ = true;}
+
+    // Recompute the hash of this node, and of any dirty node below it
+    void updateHash();
+
+    uint256 const& key() const;
+    unsigned depth() const;
+
+    // Append the wire form of this node, which must be clean, to out.  An
+    // empty root has no wire form.
+    void serialize(Blob& out) const;
+
+    // Make a node from the wire form in data[0, size), or return null if it
+    // is malformed.  The node is clean, with the hash of that data.  An inner
+    // node made this way has the hashes of its children but not the children
+    // themselves.
+    static SHAMapNodePtr<SHAMapAbstractNode>
+        deserialize(SHAMapNodePool& pool, std::uint32_t cowid,
+                    void const* data, std::size_t size);
 
     virtual void display(std::ostream& os, unsigned indent) const = 0;
     virtual void invariants(bool is_root = false) const = 0;
-    virtual uint256 const& key() const = 0;
-    virtual unsigned depth() const = 0;
     virtual unsigned max_depth(unsigned) const = 0;
+
+private:
+    // Destroy this node and give its memory back to pool_
+    void destroy() const noexcept;
 };
 
 class SHAMapTreeNode;
@@ -73,105 +331,746 @@ class SHAMapTreeNode;
 class SHAMapInnerNode
     : public SHAMapAbstractNode
 {
-    SHAMapHash                          hashes_[16] = {{}};
-    std::shared_ptr<SHAMapAbstractNode> children_[16];
-    unsigned                            isBranch_ = 0;
-    unsigned                            depth_ = 0;
-    uint256                             common_ = {};
+    using ChildPtr = SHAMapNodePtr<SHAMapAbstractNode>;
+
+    // Children and their hashes are kept only for non-empty branches, in
+    // branch order.  The slots live in a separately allocated block holding
+    // capacity_ child pointers followed by capacity_ hashes.  capacity_ is
+    // 2, 4, 8 or 16 (0 for an empty root), and follows numChildren() up and
+    // down as branches are set and cleared.
+    std::uint16_t isBranch_ = 0;
+    std::uint8_t  capacity_ = 0;
+    std::uint8_t  depth_ = 0;
+    bool          fullBelow_ = false;  // nothing below is missing
+    void*         slots_ = nullptr;
+    uint256       common_ = {};
+    std::uint64_t count_ = 0;          // items below, or unknownCount
 public:
-    explicit SHAMapInnerNode(SHAMapHash const& hash)
-        : SHAMapAbstractNode{hash}
+    static constexpr std::uint64_t unknownCount = ~std::uint64_t{0};
+
+    SHAMapInnerNode(SHAMapNodePool& pool, std::uint32_t cowid)
+        : SHAMapAbstractNode{Kind::inner, pool, cowid}
         {}
 
+    // Copy other, for writing by the map owning cowid
+    SHAMapInnerNode(SHAMapNodePool& pool, SHAMapInnerNode const& other,
+                    std::uint32_t cowid);
+
+    ~SHAMapInnerNode();
+
     bool isEmptyBranch (int m) const {return (isBranch_ & (1 << m)) == 0;}
-    SHAMapAbstractNode* getChildPointer(int m) const {return children_[m].get();}
-    std::shared_ptr<SHAMapAbstractNode> firstChild() const;
-    std::shared_ptr<SHAMapAbstractNode> getChild(int m) const {return children_[m];}
-    void setChild(int branch, std::shared_ptr<SHAMapAbstractNode> const& child);
-    void setChildren(std::shared_ptr<SHAMapTreeNode> const& child1,
-                     std::shared_ptr<SHAMapTreeNode> const& child2);
+    SHAMapAbstractNode* getChildPointer(int m) const;
+    // Start loading the slot holding branch m, which must not be empty
+    void prefetchChild(int m) const;
+    SHAMapNodePtr<SHAMapAbstractNode> firstChild() const;
+    SHAMapNodePtr<SHAMapAbstractNode> getChild(int m) const;
+    void setChild(int branch, SHAMapNodePtr<SHAMapAbstractNode> child);
+    // Drop the child of branch m from memory, keeping its hash
+    void unloadChild(int m);
+    void setChildren(SHAMapNodePtr<SHAMapTreeNode> child1,
+                     SHAMapNodePtr<SHAMapTreeNode> child2);
+    // Make room for n children without further resizing
+    void reserve(unsigned n);
 
     bool has_common_prefix(uint256 const& key) const;
     unsigned get_common_prefix(uint256 const& key) const;
     void set_common(unsigned depth, uint256 const& common);
     uint256 const& common() const {return common_;}
-    unsigned numChildren() const;
+    unsigned numChildren() const {return std::bitset<16>(isBranch_).count();}
+    // The number of child slots allocated, at least numChildren()
+    unsigned capacity() const {return capacity_;}
+    // The size of the separately allocated block holding the slots
+    std::size_t slotBlockBytes() const;
+    SHAMapHash const& getChildHash(int m) const;
+    // The number of items below.  A node made from its wire form does not
+    // know it until SHAMap counts its children.
+    std::uint64_t count() const {return count_;}
+    void setCount(std::uint64_t count) {count_ = count;}
+    // Whether every node below is known to be in memory
+    bool isFullBelow() const {return fullBelow_;}
+    void setFullBelow() {fullBelow_ = true;}
+
+    void updateHash();
+    uint256 const& key() const {return common_;}
+    unsigned depth() const {return depth_;}
+
+    void serialize(Blob& out) const;
+    // data[0, size) is the wire form after its prefix
+    static SHAMapNodePtr<SHAMapAbstractNode>
+        deserialize(SHAMapNodePool& pool, std::uint32_t cowid,
+                    unsigned char const* data, std::size_t size);
 
     void display(std::ostream& os, unsigned indent) const override;
     void invariants(bool is_root = false) const override;
-    uint256 const& key() const override;
-    unsigned depth() const override;
     unsigned max_depth(unsigned) const override;
+
+private:
+    // The slot holding branch m, if m is not empty
+    unsigned slot(int m) const
+        {return std::bitset<16>(isBranch_ & ((1u << m) - 1)).count();}
+    ChildPtr* children() const {return static_cast<ChildPtr*>(slots_);}
+    SHAMapHash* hashes() const
+        {return reinterpret_cast<SHAMapHash*>(children() + capacity_);}
+    void resize(unsigned capacity);
+
+    // Longest wire form that precedes the child hashes
+    static constexpr std::size_t maxHeader = 4 + 1 + 32 + 2;
+    // Write that part of the wire form to buf and return its length
+    std::size_t header(unsigned char* buf) const;
 };
 
+inline
+SHAMapAbstractNode*
+SHAMapInnerNode::getChildPointer(int m) const
+{
+    if (isEmptyBranch(m))
+        return nullptr;
+    return children()[slot(m)].get();
+}
+
+// A leaf made by make keeps a payload of up to maxInline bytes right after
+// itself, in the same block, so that the leaf, its key and its payload take
+// a single allocation.  A larger payload stays in the Blob of its item,
+// which an rvalue item or Blob moves in without copying.
 class SHAMapTreeNode
     : public SHAMapAbstractNode
 {
-    std::shared_ptr<SHAMapItem const> item_;
+    SHAMapItem item_;
 public:
-    explicit SHAMapTreeNode(SHAMapHash const& hash, SHAMapItem const& item)
-        : SHAMapAbstractNode{hash}
-        , item_{std::make_shared<SHAMapItem>(item)}
+    SHAMapTreeNode(SHAMapNodePool& pool, std::uint32_t cowid, SHAMapItem const& item)
+        : SHAMapAbstractNode{Kind::leaf, pool, cowid}
+        , item_{item}
+        {}
+
+    SHAMapTreeNode(SHAMapNodePool& pool, std::uint32_t cowid, SHAMapItem&& item)
+        : SHAMapAbstractNode{Kind::leaf, pool, cowid}
+        , item_{std::move(item)}
         {}
 
-    std::shared_ptr<SHAMapItem const> const& peekItem () const {return item_;}
+    // The largest payload kept in the leaf's own block
+    static std::size_t const maxInline;
+
+    static SHAMapNodePtr<SHAMapTreeNode>
+        make(SHAMapNodePool& pool, std::uint32_t cowid, SHAMapItem const& item);
+    static SHAMapNodePtr<SHAMapTreeNode>
+        make(SHAMapNodePool& pool, std::uint32_t cowid, SHAMapItem&& item);
+    static SHAMapNodePtr<SHAMapTreeNode>
+        make(SHAMapNodePool& pool, std::uint32_t cowid, uint256 const& key, Blob&& data);
+    static SHAMapNodePtr<SHAMapTreeNode>
+        make(SHAMapNodePool& pool, std::uint32_t cowid, uint256 const& key,
+             unsigned char const* data, std::size_t size);
+
+    SHAMapItem const& peekItem () const {return item_;}
+    // The size of the block holding this leaf
+    std::size_t bytes() const;
+
+    void updateHash();
+    uint256 const& key() const {return item_.key();}
+    unsigned depth() const {return 64;}
+
+    void serialize(Blob& out) const;
+    // data[0, size) is the wire form after its prefix
+    static SHAMapNodePtr<SHAMapAbstractNode>
+        deserialize(SHAMapNodePool& pool, std::uint32_t cowid,
+                    unsigned char const* data, std::size_t size);
 
     void display(std::ostream& os, unsigned indent) const override;
     void invariants(bool is_root = false) const override;
-    uint256 const& key() const override;
-    unsigned depth() const override;
     unsigned max_depth(unsigned) const override;
+
+private:
+    // Copy data[0, size) to just after this leaf, which make has allocated
+    // room for
+    SHAMapTreeNode(SHAMapNodePool& pool, std::uint32_t cowid, uint256 const& key,
+                   unsigned char const* data, std::size_t size);
+
+    unsigned char* payload() {return reinterpret_cast<unsigned char*>(this + 1);}
+    unsigned char const* payload() const
+        {return reinterpret_cast<unsigned char const*>(this + 1);}
 };
 
 inline
-bool
-SHAMapAbstractNode::isLeaf () const
+void
+SHAMapAbstractNode::updateHash()
+{
+    if (isLeaf())
+        static_cast<SHAMapTreeNode*>(this)->updateHash();
+    else
+        static_cast<SHAMapInnerNode*>(this)->updateHash();
+}
+
+inline
+uint256 const&
+SHAMapAbstractNode::key() const
+{
+    if (isLeaf())
+        return static_cast<SHAMapTreeNode const*>(this)->key();
+    return static_cast<SHAMapInnerNode const*>(this)->key();
+}
+
+inline
+unsigned
+SHAMapAbstractNode::depth() const
+{
+    if (isLeaf())
+        return static_cast<SHAMapTreeNode const*>(this)->depth();
+    return static_cast<SHAMapInnerNode const*>(this)->depth();
+}
+
+inline
+void
+SHAMapAbstractNode::serialize(Blob& out) const
+{
+    assert(!dirty_);
+    if (isLeaf())
+        static_cast<SHAMapTreeNode const*>(this)->serialize(out);
+    else
+        static_cast<SHAMapInnerNode const*>(this)->serialize(out);
+}
+
+// Memory for SHAMap nodes.  Requests are rounded up to a multiple of
+// granularity, and each such size class is carved out of its own slabs and
+// recycled through its own free list.  Requests larger than maxBlock go
+// straight to operator new.
+//
+// In arena mode freed blocks are not recycled; the slabs are all released
+// at once when the pool is destroyed.  This suits maps that are built up
+// and then dropped as a whole.
+//
+// Nodes refer to their pool by plain pointer.  A pool is shared by every map
+// and snapshot whose nodes it holds, and each of those releases its nodes
+// before its hold on the pool.  It may be used from several threads.  A
+// thread doing many allocations from a shared pool can keep a ThreadCache of
+// it, which moves blocks to and from the pool in batches under one lock.
+class SHAMapNodePool
+{
+public:
+    enum Mode {reuse, arena};
+
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t maxBlock = 1024;
+    static constexpr std::size_t slabSize = 64 * 1024;
+    // Blocks a ThreadCache takes from, or gives back to, its pool at once
+    static constexpr std::size_t cacheBatch = 32;
+
+    class ThreadCache;
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    struct SizeClass
+    {
+        FreeBlock*     free = nullptr;
+        unsigned char* next = nullptr;  // unused part of the current slab
+        unsigned char* end = nullptr;
+    };
+
+    std::mutex                  mutex_;
+    Mode                        mode_;
+    SizeClass                   classes_[maxBlock / granularity];
+    std::vector<unsigned char*> slabs_;
+
+    // The innermost ThreadCache of the calling thread, of any pool
+    static thread_local ThreadCache* threadCache_;
+
+public:
+    explicit SHAMapNodePool(Mode mode = reuse);
+    ~SHAMapNodePool();
+    SHAMapNodePool(SHAMapNodePool const&) = delete;
+    SHAMapNodePool& operator=(SHAMapNodePool const&) = delete;
+
+    void* allocate(std::size_t bytes);
+    void deallocate(void* p, std::size_t bytes) noexcept;
+    // The memory taken by an allocation of bytes
+    static std::size_t blockSize(std::size_t bytes)
+    {
+        return bytes > maxBlock ? bytes
+                                : (bytes + granularity - 1) / granularity * granularity;
+    }
+
+    template <class Node, class... Args>
+        SHAMapNodePtr<Node> make(Args&&... args);
+
+private:
+    // Take a block of c, whose blocks are size bytes; mutex_ must be held
+    void* take(SizeClass& c, std::size_t size);
+};
+
+// While it exists, blocks the creating thread allocates from or frees to
+// pool come from and go to free lists of its own, refilled from and drained
+// to pool cacheBatch blocks at a time.  The blocks it holds go back to pool
+// when it is destroyed.  It must be destroyed on the thread that made it,
+// and the ThreadCaches of one thread in the reverse order of their making.
+class SHAMapNodePool::ThreadCache
+{
+    struct List
+    {
+        FreeBlock*  free = nullptr;
+        std::size_t size = 0;
+    };
+
+    SHAMapNodePool& pool_;
+    ThreadCache*    outer_;
+    List            lists_[maxBlock / granularity];
+
+    friend class SHAMapNodePool;
+public:
+    explicit ThreadCache(SHAMapNodePool& pool);
+    ~ThreadCache();
+    ThreadCache(ThreadCache const&) = delete;
+    ThreadCache& operator=(ThreadCache const&) = delete;
+};
+
+template <class Node, class... Args>
+SHAMapNodePtr<Node>
+SHAMapNodePool::make(Args&&... args)
+{
+    void* p = allocate(sizeof(Node));
+    Node* node;
+    try
+    {
+        node = ::new(p) Node(*this, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        deallocate(p, sizeof(Node));
+        throw;
+    }
+    return SHAMapNodePtr<Node>{node};
+}
+
+inline
+void
+SHAMapAbstractNode::release() const
 {
-    return dynamic_cast<SHAMapTreeNode const*>(this) != nullptr;
+    if (refcount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        destroy();
 }
 
+// Where nodes that are known only by their hash are kept, in their wire form
+// (see SHAMapAbstractNode).  A store may be shared by several maps and used
+// from several threads.
+class SHAMapNodeStore
+{
+public:
+    virtual ~SHAMapNodeStore() = default;
+
+    // Keep data as the wire form of the node with the given hash.  A node
+    // that is already present may be ignored.
+    virtual void store(SHAMapHash const& hash, Blob const& data) = 0;
+
+    // Set data to the wire form of the node with the given hash, or return
+    // false if there is no such node
+    virtual bool fetch(SHAMapHash const& hash, Blob& data) = 0;
+};
+
+// A node store kept in a single file.  Each record is a node's hash, the
+// length of its wire form as four big-endian bytes, and the wire form.
+// Records are only ever appended.  Opening the store scans the file to
+// build an index of where each record starts; a partial record at the end,
+// as left by a crash, is ignored and overwritten.
+class SHAMapFileStore
+    : public SHAMapNodeStore
+{
+    std::mutex                                       mutex_;
+    std::fstream                                     file_;
+    std::uint64_t                                    end_ = 0;
+    std::map<SHAMapHash, std::pair<std::uint64_t, std::uint32_t>> index_;
+
+public:
+    // Open the store in path, creating the file if need be
+    explicit SHAMapFileStore(std::string const& path);
+
+    void store(SHAMapHash const& hash, Blob const& data) override;
+    bool fetch(SHAMapHash const& hash, Blob& data) override;
+};
+
+// A cache of nodes loaded from a SHAMapNodeStore, keyed by hash, that may be
+// shared by any number of maps.  Consecutive versions of a map share most of
+// their nodes, so a node loaded for one version is found here by the next.
+// Nodes handed out by the cache are shared between maps and are never
+// modified in place.  A map links in cached leaves as they are, but links in
+// its own copy of each cached inner node, and it is into that copy that the
+// children it loads are linked.  A cached inner node thus holds the hashes
+// of its children but never the children themselves.
+//
+// The cache holds nodes until their total size would exceed its byte
+// budget, and then evicts using the CLOCK policy.  Since cached nodes hold
+// no other nodes, the budget bounds the memory the cache keeps.  Each shard
+// has its own lock, its own part of the budget and its own clock hand, so
+// the cache may be used from several threads.
+//
+// The budget covers only the cache.  Each map also keeps every node it
+// loads, an inner node in its own copy, until SHAMap::unload drops the ones
+// it has not changed; a node evicted from the cache lives on until then.
+// A map that calls unload between walks holds little more than its own
+// changes, and finds the nodes it reaches again in the cache.
+class SHAMapNodeCache
+{
+    struct Entry
+    {
+        SHAMapHash                        hash;
+        SHAMapNodePtr<SHAMapAbstractNode> node;
+        std::size_t                       bytes = 0;
+        bool                              referenced = false;
+    };
+
+    struct HashHasher
+    {
+        std::size_t operator()(SHAMapHash const& h) const;
+    };
+
+    struct Shard
+    {
+        std::mutex                                            mutex;
+        std::vector<Entry>                                    entries;
+        std::vector<std::size_t>                              free;
+        std::unordered_map<SHAMapHash, std::size_t, HashHasher> index;
+        std::size_t                                           hand = 0;
+        std::size_t                                           bytes = 0;
+    };
+
+    std::shared_ptr<SHAMapNodePool> pool_;   // must outlive shards_
+    std::size_t                     budget_;
+    std::vector<Shard>              shards_;
+    std::atomic<std::uint64_t>      hits_{0};
+    std::atomic<std::uint64_t>      misses_{0};
+
+public:
+    // Cache up to budget bytes of nodes, split evenly over shards shards
+    explicit SHAMapNodeCache(std::size_t budget, unsigned shards = 16);
+    SHAMapNodeCache(SHAMapNodeCache const&) = delete;
+    SHAMapNodeCache& operator=(SHAMapNodeCache const&) = delete;
+
+    // The pool the nodes of maps using this cache are allocated from
+    std::shared_ptr<SHAMapNodePool> const& pool() const {return pool_;}
+
+    // Returns the node with the given hash, or null if it is not cached
+    SHAMapNodePtr<SHAMapAbstractNode> fetch(SHAMapHash const& hash);
+    // Cache node, which must be clean and have cowid 0, evicting other nodes
+    // as needed to stay within budget
+    void insert(SHAMapNodePtr<SHAMapAbstractNode> const& node);
+
+    std::uint64_t hits() const {return hits_.load(std::memory_order_relaxed);}
+    std::uint64_t misses() const {return misses_.load(std::memory_order_relaxed);}
+    std::size_t budget() const {return budget_;}
+    // The total size of the cached nodes
+    std::size_t bytes();
+};
+
+// Thrown when a node that is known only by its hash cannot be loaded
+class SHAMapMissingNode
+    : public std::runtime_error
+{
+    SHAMapHash hash_;
+public:
+    explicit SHAMapMissingNode(SHAMapHash const& hash);
+
+    SHAMapHash const& hash() const {return hash_;}
+};
 
 class SHAMap
 {
-    using NodeStack = std::vector<std::pair<std::shared_ptr<SHAMapAbstractNode>,
-                                  SHAMapNodeID>>;
+    class NodeStack;
 
-    std::shared_ptr<SHAMapAbstractNode> root_;
+    std::uint32_t                     cowid_;
+    bool                              mutable_ = true;
+    std::shared_ptr<SHAMapNodePool>   pool_;   // must outlive root_
+    std::shared_ptr<SHAMapNodeStore>  store_;
+    std::shared_ptr<SHAMapNodeCache>  cache_;  // must outlive root_
+    SHAMapNodePtr<SHAMapAbstractNode> root_;
 public:
-    SHAMap();
+    // All nodes of the map, and of its snapshots, are allocated from pool
+    explicit SHAMap(std::shared_ptr<SHAMapNodePool> pool =
+                        std::make_shared<SHAMapNodePool>());
+
+    // Open the map with the given root hash in store.  Only the root is
+    // loaded; every other node is fetched from store the first time it is
+    // reached, and then kept until unload.  Throws SHAMapMissingNode if the root is not
+    // in store, and lookups throw it if a node they reach is not.  Since
+    // loading links nodes into the tree, such a map and its snapshots must
+    // not be read from several threads at once.
+    SHAMap(SHAMapHash const& root, std::shared_ptr<SHAMapNodeStore> store,
+           std::shared_ptr<SHAMapNodePool> pool = std::make_shared<SHAMapNodePool>());
+
+    // As above, except that nodes are looked for in cache before store, and
+    // nodes loaded from store are added to cache.  The map allocates its
+    // nodes from the pool of cache.
+    SHAMap(SHAMapHash const& root, std::shared_ptr<SHAMapNodeStore> store,
+           std::shared_ptr<SHAMapNodeCache> cache);
+
+    // Start a map with the given root hash from the wire form of its root
+    // node alone, typically to be filled in from peers with getMissingNodes
+    // and addKnownNode.  Throws SHAMapMissingNode if rootNode is not the
+    // root with that hash.
+    SHAMap(SHAMapHash const& root, Blob const& rootNode,
+           std::shared_ptr<SHAMapNodePool> pool = std::make_shared<SHAMapNodePool>());
+    SHAMap(SHAMap&&) = default;
+    SHAMap& operator=(SHAMap&& x);
 
-    bool insert(SHAMapHash const& hash, SHAMapItem const& item);
+    // Returns an immutable map holding the current contents, in O(1).  The
+    // two maps share all nodes; later changes to this map copy only the
+    // nodes on the path they modify.
+    SHAMap snapshot();
+    bool isMutable() const {return mutable_;}
+
+    // Add item unless its key is already present, and return whether it was
+    // added.  The new leaf holds a small payload in its own block (see
+    // SHAMapTreeNode), so it takes a single allocation.  The rvalue forms
+    // move a larger payload into the leaf, copying no payload bytes.  The
+    // data is copied or moved only if the key is absent.
+    bool insert(SHAMapItem const& item);
+    bool insert(SHAMapItem&& item);
+    bool emplace(uint256 const& key, Blob&& data);
+
+    // Insert the items in [first, last), in any order, using up to threads
+    // threads, the calling thread included, and return the number added.
+    // The items are bucketed by the root's branch for their key, and a
+    // bucket too large for an even share of the work is bucketed again by
+    // the branches of the inner node below, if all its keys fall under it.
+    // Each bucket is then inserted into its own subtree by whichever thread
+    // is free, and the new subtrees are linked in afterwards.
+    template <class FwdIt>
+        std::size_t insert_parallel(FwdIt first, FwdIt last, unsigned threads);
+
+    // Replace the contents with the items in [first, last), which must be
+    // sorted by strictly increasing key.  The tree is built bottom up in one
+    // pass, creating each inner node once in its final shape.  If hash is
+    // true the nodes are also hashed during that pass.
+    template <class FwdIt>
+        void assign(FwdIt first, FwdIt last, bool hash = false);
+
+    // Returns the root hash, first rehashing every node dirtied since the
+    // last call.  An empty map hashes to zero.  With threads > 1 the dirty
+    // subtrees are hashed concurrently on that many threads, the calling
+    // thread included.
+    SHAMapHash const& getHash(unsigned threads = 1) const;
 
     friend std::ostream& operator<<(std::ostream& os, SHAMap const& x);
 
     class const_iterator;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
     const_iterator begin() const;
     const_iterator end() const;
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
 
     const_iterator findKey(uint256 const& id) const;
+
+    // Look up keys[0, n), storing in out[i] the item with key keys[i], or
+    // nullptr if there is none.  Lookups are interleaved one tree level at a
+    // time, prefetching each node before it is needed, so that the cache
+    // misses of different keys overlap.
+    void findKeys(uint256 const* keys, std::size_t n, SHAMapItem const** out) const;
+    const_iterator lower_bound(uint256 const& id) const;
     const_iterator upper_bound(uint256 const& id) const;
+    // The last item with a key less than id, or end() if there is none
+    const_iterator predecessor(uint256 const& id) const;
+
+    // The number of items.  Every inner node keeps the number of items
+    // below it, so this is O(1), and rank and nth descend once through the
+    // tree.  Nodes loaded from a store are counted, loading whatever is
+    // below them, the first time their count is needed.
+    std::size_t size() const;
+    // The number of items with a key less than id
+    std::size_t rank(uint256 const& id) const;
+    // The item at position i in key order, or end() if i >= size()
+    const_iterator nth(std::size_t i) const;
+
+    // Returns the wire forms of the nodes on the path from the root towards
+    // key, rehashing the map first if it is dirty.  The path ends at the
+    // leaf holding key if there is one.  Otherwise it ends where the search
+    // for key stopped: at a leaf with another key, or at an inner node that
+    // has no branch for key or whose prefix key does not share.  Either way
+    // verifyProofPath can check it against the root hash.  An empty map
+    // gives an empty path.
+    std::vector<Blob> getProofPath(uint256 const& key) const;
+
+    // Insert item unless its key is already present, and return an iterator
+    // to the item with that key.  The search starts from the deepest node on
+    // the path of hint whose prefix the key shares, rather than from the
+    // root, so a stream of nearby keys, each inserted with the iterator
+    // returned for the one before, walks only the bottom of the tree.  hint
+    // may be any iterator into this map, end() included.  Other changes to
+    // the map invalidate hint as an iterator, but it may still be passed
+    // here: only the part of its path that is still in the tree is used,
+    // which may leave a longer search.
+    const_iterator insert(const_iterator hint, SHAMapItem const& item);
+    const_iterator insert(const_iterator hint, SHAMapItem&& item);
 
     const_iterator erase(const_iterator i);
+    // Erase the item with key, if there is one, and return whether there was.
+    // Unlike erasing through an iterator this does not find the next item.
+    bool erase(uint256 const& key);
+    // Erase the items with keys[0, n), which must be sorted by strictly
+    // increasing key, and return the number erased.  The keys are taken a
+    // subtree at a time: each inner node is copied, marked dirty and
+    // collapsed at most once for the whole batch.
+    std::size_t erase_batch(uint256 const* keys, std::size_t n);
+
+    // Report every item that differs between this map and other, in key
+    // order.  visitor(mine, theirs) is called with the item from this map and
+    // the item with the same key from other; mine is nullptr for an item only
+    // in other, and theirs is nullptr for an item only in this map.  Subtrees
+    // whose hashes agree are skipped, so the work done is proportional to the
+    // number of differences rather than to the size of the maps.  Both maps
+    // are rehashed first if they are dirty.
+    template <class Visitor>
+        void compare(SHAMap const& other, Visitor&& visitor) const;
+
+    // Returns up to max nodes that are known by hash but are neither in
+    // memory nor in the store or cache of the map, as the position of each
+    // (the depth and prefix of the branch leading to it) and its hash.  The
+    // nodes are found breadth first, so that the nodes of each level can be
+    // requested together.  Nodes for which filter returns false, say because
+    // they have already been requested, are left out.  Subtrees found to be
+    // complete are remembered, so that later calls do not search them again.
+    std::vector<std::pair<SHAMapNodeID, SHAMapHash>>
+        getMissingNodes(std::size_t max,
+                        std::function<bool(SHAMapHash const&)> const& filter = nullptr);
+
+    enum class AddNode {useful, duplicate, invalid};
+
+    // Link in the node whose wire form is data at position id, as reported
+    // by getMissingNodes.  Returns invalid, leaving the map unchanged, if
+    // there is no such position or data does not have the hash the parent
+    // expects there.
+    AddNode addKnownNode(SHAMapNodeID const& id, Blob const& data);
+
+    // Write every node of the map that is in memory to store, rehashing the
+    // map first if it is dirty.  Nodes that were never loaded are taken to
+    // be in store already.
+    void save(SHAMapNodeStore& store) const;
+
+    // Drop from memory the nodes below the root that were loaded from the
+    // store and have not changed since, and that have nothing below them
+    // that exists only in memory, keeping their hashes.  They are loaded
+    // again, from the cache if the map has one, when next reached.  Nodes
+    // shared with a snapshot are left alone.  Invalidates iterators.
+    void unload();
+
+    // Write the map to path in the layout read by SHAMapMapped, rehashing the
+    // map first if it is dirty
+    void saveMapped(std::string const& path) const;
 
     void display(std::ostream& os) const;
 
     void invariants() const;
     unsigned max_depth() const;
 private:
+    SHAMap(SHAMap const& x, bool isMutable);
+    SHAMap(SHAMapHash const& root, std::shared_ptr<SHAMapNodeStore> store,
+           std::shared_ptr<SHAMapNodePool> pool,
+           std::shared_ptr<SHAMapNodeCache> cache);
+
+    void assign(std::vector<SHAMapItem const*> const& items, bool hash);
+    std::size_t insertParallel(std::vector<SHAMapItem const*>& items, unsigned threads);
+    std::size_t eraseBelow(NodeStack& stack, uint256 const* first, uint256 const* last);
+    SHAMapAbstractNode* collapse(SHAMapInnerNode* parent, int branch,
+                                 SHAMapInnerNode* inner);
+    SHAMapNodePtr<SHAMapAbstractNode>
+        buildSubtree(SHAMapItem const* const* first, SHAMapItem const* const* last,
+                     bool hash);
+    void fillInner(SHAMapInnerNode& inner, SHAMapItem const* const* first,
+                   SHAMapItem const* const* last, bool hash);
+
+    using DiffVisitor = std::function<void(SHAMapItem const*, SHAMapItem const*)>;
+    void diff(SHAMap const& other, SHAMapAbstractNode* mine,
+              SHAMapAbstractNode* theirs, DiffVisitor const& visitor) const;
+
+    void unshare(NodeStack& stack);
     SHAMapTreeNode* walkTowardsKey(uint256 const& id, NodeStack* stack = nullptr) const;
     SHAMapItem const* peekFirstItem(NodeStack& stack) const;
-    SHAMapItem const* peekNextItem(uint256 const& id, NodeStack& stack) const;
-    SHAMapTreeNode* firstBelow(std::shared_ptr<SHAMapAbstractNode> node,
+    SHAMapItem const* peekNextItem(NodeStack& stack) const;
+    SHAMapItem const* peekPrevItem(NodeStack& stack) const;
+    SHAMapTreeNode* firstBelow(SHAMapAbstractNode* node, int branch,
                                NodeStack& stack) const;
+    SHAMapTreeNode* lastBelow(SHAMapAbstractNode* node, int branch,
+                              NodeStack& stack) const;
+    const_iterator bound(uint256 const& id, bool inclusive) const;
+    template <class... Leaf>
+        bool insertItem(NodeStack& stack, uint256 key, Leaf&&... leaf);
+    NodeStack hintStack(const_iterator const& hint, uint256 const& key) const;
+    static void dirtyUp(NodeStack const& stack);
+    static void countUp(NodeStack const& stack, int change);
+    std::uint64_t countBelow(SHAMapAbstractNode* node) const;
+    SHAMapNodePtr<SHAMapAbstractNode>
+        fetchNode(SHAMapHash const& hash, std::uint32_t cowid) const;
+    SHAMapNodePtr<SHAMapAbstractNode>
+        tryFetchNode(SHAMapHash const& hash, std::uint32_t cowid) const;
+    SHAMapNodePtr<SHAMapAbstractNode>
+        makeNode(SHAMapHash const& hash, Blob const& data, std::uint32_t cowid) const;
     SHAMapAbstractNode* descendThrow(SHAMapInnerNode* parent, int branch) const;
-    std::shared_ptr<SHAMapAbstractNode>
-        descendThrow(std::shared_ptr<SHAMapInnerNode> parent, int branch) const;
+    bool unloadBelow(SHAMapInnerNode* inner);
+    struct MappedSize
+    {
+        std::uint64_t bytes;
+        std::uint64_t nodes;
+    };
+    void sizeMapped(SHAMapAbstractNode* node, std::vector<MappedSize>& sizes) const;
+    void writeMapped(std::ostream& out, SHAMapAbstractNode* node,
+                     std::vector<MappedSize> const& sizes, std::size_t& index) const;
+};
+
+// The nodes on a path down from the root, as plain pointers, each with the
+// branch of its parent that it hangs from (-1 for the root).  A key has 64
+// nibbles, so there are at most 64 inner nodes above a leaf, and the path is
+// kept inline without allocating.
+class SHAMap::NodeStack
+{
+public:
+    static constexpr unsigned capacity = 65;
+
+private:
+    SHAMapAbstractNode* nodes_[capacity];
+    std::int8_t         branches_[capacity];
+    unsigned            size_ = 0;
+
+public:
+    NodeStack() = default;
+
+    NodeStack(NodeStack const& x)
+        : size_{x.size_}
+    {
+        std::copy(x.nodes_, x.nodes_ + size_, nodes_);
+        std::copy(x.branches_, x.branches_ + size_, branches_);
+    }
+
+    NodeStack& operator=(NodeStack const& x)
+    {
+        size_ = x.size_;
+        std::copy(x.nodes_, x.nodes_ + size_, nodes_);
+        std::copy(x.branches_, x.branches_ + size_, branches_);
+        return *this;
+    }
+
+    bool empty() const {return size_ == 0;}
+    unsigned size() const {return size_;}
+
+    SHAMapAbstractNode* node(unsigned i) const {return nodes_[i];}
+    int branch(unsigned i) const {return branches_[i];}
+    SHAMapAbstractNode* back() const {return nodes_[size_-1];}
+
+    void push_back(SHAMapAbstractNode* node, int branch)
+    {
+        assert(size_ < capacity);
+        nodes_[size_] = node;
+        branches_[size_] = static_cast<std::int8_t>(branch);
+        ++size_;
+    }
+
+    void pop_back() {--size_;}
+
+    void replace(unsigned i, SHAMapAbstractNode* node) {nodes_[i] = node;}
 };
 
 class SHAMap::const_iterator
 {
 public:
-    using iterator_category = std::forward_iterator_tag;
+    using iterator_category = std::bidirectional_iterator_tag;
     using difference_type   = std::ptrdiff_t;
     using value_type        = SHAMapItem;
     using reference         = value_type const&;
@@ -190,16 +1089,48 @@ public:
 
     const_iterator& operator++();
     const_iterator  operator++(int);
+    const_iterator& operator--();
+    const_iterator  operator--(int);
 
 private:
     explicit const_iterator(SHAMap const* map);
     const_iterator(SHAMap const* map, pointer item);
-    const_iterator(SHAMap const* map, pointer item, NodeStack&& stack);
+    const_iterator(SHAMap const* map, pointer item, NodeStack const& stack);
 
     friend bool operator==(const_iterator const& x, const_iterator const& y);
     friend class SHAMap;
 };
 
+template <class FwdIt>
+void
+SHAMap::assign(FwdIt first, FwdIt last, bool hash)
+{
+    std::vector<SHAMapItem const*> items;
+    for (; first != last; ++first)
+        items.push_back(&*first);
+    assign(items, hash);
+}
+
+template <class FwdIt>
+std::size_t
+SHAMap::insert_parallel(FwdIt first, FwdIt last, unsigned threads)
+{
+    std::vector<SHAMapItem const*> items;
+    for (; first != last; ++first)
+        items.push_back(&*first);
+    return insertParallel(items, threads);
+}
+
+template <class Visitor>
+void
+SHAMap::compare(SHAMap const& other, Visitor&& visitor) const
+{
+    getHash();
+    other.getHash();
+    diff(other, root_.get(), other.root_.get(),
+         DiffVisitor{std::forward<Visitor>(visitor)});
+}
+
 inline
 SHAMap::const_iterator::const_iterator(SHAMap const* map)
     : map_(map)
@@ -216,8 +1147,8 @@ SHAMap::const_iterator::const_iterator(SHAMap const* map, pointer item)
 
 inline
 SHAMap::const_iterator::const_iterator(SHAMap const* map, pointer item,
-                                       NodeStack&& stack)
-    : stack_(std::move(stack))
+                                       NodeStack const& stack)
+    : stack_(stack)
     , map_(map)
     , item_(item)
 {
@@ -241,7 +1172,7 @@ inline
 SHAMap::const_iterator&
 SHAMap::const_iterator::operator++()
 {
-    item_ = map_->peekNextItem(item_->key(), stack_);
+    item_ = map_->peekNextItem(stack_);
     return *this;
 }
 
@@ -254,6 +1185,23 @@ SHAMap::const_iterator::operator++(int)
     return tmp;
 }
 
+inline
+SHAMap::const_iterator&
+SHAMap::const_iterator::operator--()
+{
+    item_ = map_->peekPrevItem(stack_);
+    return *this;
+}
+
+inline
+SHAMap::const_iterator
+SHAMap::const_iterator::operator--(int)
+{
+    auto tmp = *this;
+    --(*this);
+    return tmp;
+}
+
 inline
 bool
 operator==(SHAMap::const_iterator const& x, SHAMap::const_iterator const& y)
@@ -283,4 +1231,235 @@ SHAMap::end() const
     return const_iterator(this, nullptr);
 }
 
+inline
+SHAMap::const_reverse_iterator
+SHAMap::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+inline
+SHAMap::const_reverse_iterator
+SHAMap::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
+// Lets one writer thread publish successive versions of a map while any
+// number of reader threads look up keys in, and iterate over, the latest
+// published version without taking a lock.
+//
+// A version is a snapshot of the writer's map, hashed and with its subtree
+// item counts settled before it is published, so that nothing a reader
+// calls, size, rank and nth included, writes to a node.  The writer
+// goes on changing its own map, which copies the nodes on each changed path
+// instead of writing to nodes a version shares.  The current version is
+// published through one atomic pointer.
+//
+// A reader pins the version it reads by recording the current epoch in one
+// of a fixed number of reader slots before loading that pointer.  Any number
+// of threads may read, but at most that many Readers exist at once; read
+// waits for a slot to be released while every slot is pinned, so a thread
+// must not call read while it already holds a Reader.  publish
+// retires the version it replaces under the epoch at that moment, and then
+// advances the epoch.  A retired version is destroyed by a later publish,
+// releasing the nodes no other version shares, once no slot holds its epoch
+// or an earlier one.
+//
+// A version read concurrently must be held wholly in memory, because a map
+// backed by a SHAMapNodeStore links in the nodes it loads as it reads.
+class SHAMapPublisher
+{
+    static constexpr std::uint64_t idle = ~std::uint64_t{0};
+
+    // Each reader's slot is on its own cache line
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> epoch{idle};
+    };
+
+    std::atomic<SHAMap const*>       current_;
+    std::atomic<std::uint64_t>       epoch_{0};
+    // Before C++17 new does not honor the alignment of Slot, so the slots
+    // are placed in storage_ at the first suitably aligned address
+    std::unique_ptr<unsigned char[]> storage_;
+    Slot*                            slots_;
+    std::size_t                      numSlots_;
+    // Replaced versions and the epochs they were retired in; writer only
+    std::vector<std::pair<SHAMap const*, std::uint64_t>> retired_;
+
+public:
+    class Reader;
+
+    // Publish a snapshot of map as the first version, with readers reader
+    // slots.  Throws std::invalid_argument if readers is 0.
+    explicit SHAMapPublisher(SHAMap& map, std::size_t readers = 64);
+    // No Reader may outlive the publisher
+    ~SHAMapPublisher();
+    SHAMapPublisher(SHAMapPublisher const&) = delete;
+    SHAMapPublisher& operator=(SHAMapPublisher const&) = delete;
+
+    // Writer: make a snapshot of map the current version, and destroy the
+    // retired versions that no reader can still hold
+    void publish(SHAMap& map);
+    // Writer: the number of retired versions not yet destroyed
+    std::size_t retired() const {return retired_.size();}
+
+    // Reader: pin the current version until the returned Reader is
+    // destroyed.  Waits for a free reader slot if every one is pinned.
+    Reader read();
+
+private:
+    void reclaim();
+};
+
+class SHAMapPublisher::Reader
+{
+    Slot*         slot_;
+    SHAMap const* map_;
+
+    friend class SHAMapPublisher;
+    Reader(Slot* slot, SHAMap const* map)
+        : slot_{slot}
+        , map_{map}
+        {}
+public:
+    Reader(Reader&& x)
+        : slot_{x.slot_}
+        , map_{x.map_}
+    {
+        x.slot_ = nullptr;
+    }
+
+    Reader& operator=(Reader&&) = delete;
+
+    ~Reader()
+    {
+        if (slot_ != nullptr)
+            slot_->epoch.store(idle);
+    }
+
+    SHAMap const& operator*() const {return *map_;}
+    SHAMap const* operator->() const {return map_;}
+};
+
+enum class SHAMapProof {included, excluded, invalid};
+
+// Check a path returned by SHAMap::getProofPath(key) against the root hash
+// of the map, using only the hashes and shapes of the nodes on the path.
+// Returns included if the map holds key, excluded if it does not, and
+// invalid if the path does not prove either.  When key is included, the
+// item's data follows the prefix and key in path.back().
+SHAMapProof verifyProofPath(SHAMapHash const& root, uint256 const& key,
+                            std::vector<Blob> const& path);
+
+// A read-only map whose nodes are read in place from a memory-mapped file
+// written by SHAMap::saveMapped.  Opening one costs only the mapping; the
+// pages holding the nodes a lookup visits are read in by the OS as they are
+// touched, and are shared by every process mapping the same file.
+//
+// The file starts with the 8 byte magic "SHAMAPM1" and the offset of the
+// root node, or 0 for an empty map.  Nodes follow in depth-first order,
+// each parent before its children, and each aligned to 8 bytes.  All
+// integers are little endian.  Every node starts with a kind byte, 0 for
+// an inner node and 1 for a leaf, and has its hash at offset 8 and its key
+// (for an inner node, its common prefix) at offset 40.  An inner node has
+// its depth at offset 1, its branch bitmap at offset 2, and from offset 72
+// the 8 byte offsets of its children relative to itself, one per non-empty
+// branch.  A leaf has the length of its data at offset 4 and the data
+// itself from offset 72.
+//
+// A lookup that runs into a malformed part of the file throws
+// std::runtime_error.
+class SHAMapMapped
+{
+    unsigned char const* base_ = nullptr;
+    std::size_t          size_ = 0;
+    std::uint64_t        root_ = 0;
+
+public:
+    // A view of an item in the mapping, valid as long as the map is
+    class Item
+    {
+        unsigned char const* p_ = nullptr;
+    public:
+        Item() = default;
+        explicit Item(unsigned char const* p)
+            : p_{p}
+            {}
+
+        uint256 key() const;
+        unsigned char const* data() const {return p_ + 72;}
+        std::size_t size() const;
+    };
+
+    class const_iterator;
+
+    // Map the file in path.  Throws std::runtime_error if it cannot be mapped
+    // or does not start like a file written by SHAMap::saveMapped.
+    explicit SHAMapMapped(std::string const& path);
+    ~SHAMapMapped();
+    SHAMapMapped(SHAMapMapped const&) = delete;
+    SHAMapMapped& operator=(SHAMapMapped const&) = delete;
+
+    // Same as the hash of the SHAMap that was saved
+    SHAMapHash getHash() const;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator findKey(uint256 const& id) const;
+    const_iterator upper_bound(uint256 const& id) const;
+
+private:
+    // The node at offset, checked to lie entirely within the file
+    unsigned char const* node(std::uint64_t offset) const;
+    // The child of the inner node at offset in branch, or 0 if there is none
+    std::uint64_t child(std::uint64_t offset, int branch) const;
+    void firstBelow(std::uint64_t offset, const_iterator& i) const;
+    void next(const_iterator& i) const;
+};
+
+class SHAMapMapped::const_iterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type   = std::ptrdiff_t;
+    using value_type        = Item;
+    using reference         = value_type const&;
+    using pointer           = value_type const*;
+
+private:
+    // The nodes from the root down to the current leaf.  A key has 64
+    // nibbles, so there are at most 64 inner nodes above a leaf.
+    SHAMapMapped const* map_ = nullptr;
+    std::uint64_t       path_[65];
+    unsigned            size_ = 0;   // 0 at the end
+    Item                item_;
+
+public:
+    const_iterator() = default;
+
+    reference operator*()  const {return item_;}
+    pointer   operator->() const {return &item_;}
+
+    const_iterator& operator++();
+    const_iterator  operator++(int);
+
+    friend bool operator==(const_iterator const& x, const_iterator const& y)
+    {
+        assert(x.map_ == y.map_);
+        return x.size_ == 0 ? y.size_ == 0 : y.size_ != 0 &&
+                              x.path_[x.size_-1] == y.path_[y.size_-1];
+    }
+    friend bool operator!=(const_iterator const& x, const_iterator const& y)
+        {return !(x == y);}
+
+private:
+    explicit const_iterator(SHAMapMapped const* map)
+        : map_{map}
+        {}
+
+    friend class SHAMapMapped;
+};
+
 #endif  // SHAMAP_H